@@ -0,0 +1,32 @@
+-- Microbenchmark: format strings that are mostly literal text
+--
+-- Run against a database with format_x installed:
+--
+--     psql -X -f bench/literal.sql
+--
+-- Each query formats 100000 rows through a long constant format string with a
+-- few format specifiers, first with the builtin format() as a baseline and then
+-- with format_x(). Compare the timings between builds.
+
+\set rows 100000
+\timing on
+
+-- 4KB of literal text, 2 format specifiers
+SELECT count(format(repeat('<td class="cell">lorem ipsum dolor sit amet</td>', 80) || '%s %s', i, i))
+  FROM generate_series(1, :rows) i;
+SELECT count(format_x(repeat('<td class="cell">lorem ipsum dolor sit amet</td>', 80) || '%s %s', i, i))
+  FROM generate_series(1, :rows) i;
+
+-- 4KB of literal text with a format specifier every ~500 bytes
+SELECT count(format(repeat(repeat('SELECT col FROM tab WHERE x = 1 AND ', 14) || '%1$s ', 8), i))
+  FROM generate_series(1, :rows) i;
+SELECT count(format_x(repeat(repeat('SELECT col FROM tab WHERE x = 1 AND ', 14) || '%1$s ', 8), i))
+  FROM generate_series(1, :rows) i;
+
+-- 64KB of literal text, 1 format specifier
+SELECT count(format(repeat('x', 65536) || '%s', i))
+  FROM generate_series(1, :rows / 10) i;
+SELECT count(format_x(repeat('x', 65536) || '%s', i))
+  FROM generate_series(1, :rows / 10) i;
+
+\timing off
@@ -0,0 +1,2 @@
+-- rows: format_x_bench.document
+SELECT count(format('%s, capital %s <%s>', data->>'name', data->'capital'->>'name', data->'capital'->>'code')) FROM format_x_bench.document;
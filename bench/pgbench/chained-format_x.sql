@@ -0,0 +1,2 @@
+-- rows: format_x_bench.document
+SELECT count(format_x('%(name)s, capital %(capital.name)s <%(capital.code)s>', data)) FROM format_x_bench.document;
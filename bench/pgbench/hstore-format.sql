@@ -0,0 +1,2 @@
+-- rows: format_x_bench.entry
+SELECT count(format('%s <%s> %s', data->'name', data->'code', data->'population')) FROM format_x_bench.entry;
@@ -0,0 +1,2 @@
+-- rows: format_x_bench.document
+SELECT count(format_x('%(name)s <%(code)s> %(population)s', data)) FROM format_x_bench.document;
@@ -0,0 +1,2 @@
+-- rows: format_x_bench.nation
+SELECT count(format('%s: %s <%s> %s', id, name, code, population)) FROM format_x_bench.nation;
@@ -0,0 +1,2 @@
+-- rows: format_x_bench.nation
+SELECT count(format_x('%s: %s <%s> %s', id, name, code, population)) FROM format_x_bench.nation;
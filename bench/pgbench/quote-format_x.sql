@@ -0,0 +1,2 @@
+-- rows: format_x_bench.nation
+SELECT count(format_x('UPDATE %I SET code = %L WHERE name = %L', name, code, name)) FROM format_x_bench.nation;
@@ -0,0 +1,2 @@
+-- rows: format_x_bench.nation
+SELECT count(format('%s <%s> %s', (n).name, (n).code, (n).population)) FROM format_x_bench.nation n;
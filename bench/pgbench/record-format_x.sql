@@ -0,0 +1,2 @@
+-- rows: format_x_bench.nation
+SELECT count(format_x('%(name)s <%(code)s> %(population)s', n)) FROM format_x_bench.nation n;
@@ -0,0 +1,2 @@
+-- rows: format_x_bench.toasted
+SELECT count(format_x('%s: %s', id, body)) FROM format_x_bench.toasted;
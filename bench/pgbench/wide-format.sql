@@ -0,0 +1,4 @@
+-- rows: format_x_bench.wide
+SELECT count(format('%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s',
+  c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11, c12, c13, c14, c15, c16, c17, c18, c19, c20))
+  FROM format_x_bench.wide;
@@ -0,0 +1,3 @@
+-- rows: format_x_bench.wide
+SELECT count(format_x('%(c1)s,%(c2)s,%(c3)s,%(c4)s,%(c5)s,%(c6)s,%(c7)s,%(c8)s,%(c9)s,%(c10)s,%(c11)s,%(c12)s,%(c13)s,%(c14)s,%(c15)s,%(c16)s,%(c17)s,%(c18)s,%(c19)s,%(c20)s', w))
+  FROM format_x_bench.wide w;
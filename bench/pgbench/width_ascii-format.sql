@@ -0,0 +1,2 @@
+-- rows: format_x_bench.label
+SELECT count(format('|%30s|%-30s|', ascii, ascii)) FROM format_x_bench.label;
@@ -0,0 +1,2 @@
+-- rows: format_x_bench.label
+SELECT count(format_x('|%30s|%-30s|', utf8, utf8)) FROM format_x_bench.label;
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Benchmark format_x() against the builtin format(), run by `make bench`.
+#
+# Loads the fixtures in bench/setup.sql into BENCH_DB and runs each pair of
+# scripts bench/pgbench/<case>-format.sql and <case>-format_x.sql with pgbench
+# for BENCH_TIME seconds on one connection. Each script formats every row of
+# the table named by its "-- rows:" line, so rows/sec is pgbench's tps times
+# the number of rows and the per-row latency is pgbench's average latency
+# divided by the number of rows. The last column is the rows/sec of format_x()
+# relative to format().
+#
+#     make bench BENCH_DB=bench BENCH_TIME=30 BENCH_ROWS=100000
+#
+# Connection settings are taken from the usual PGHOST, PGPORT, PGUSER, ...
+
+set -e
+
+BENCH_DB=${BENCH_DB:-postgres}
+BENCH_TIME=${BENCH_TIME:-10}
+BENCH_ROWS=${BENCH_ROWS:-10000}
+PSQL=${PSQL:-psql}
+PGBENCH=${PGBENCH:-pgbench}
+
+dir=$(dirname "$0")
+
+"$PSQL" -X -q -v ON_ERROR_STOP=1 -v rows="$BENCH_ROWS" -d "$BENCH_DB" -f "$dir/setup.sql"
+
+printf '%-12s %-10s %14s %14s %8s\n' case function rows/sec us/row ratio
+
+for baseline in "$dir"/pgbench/*-format.sql; do
+  case=$(basename "$baseline" -format.sql)
+  table=$(sed -n 's/^-- rows: *//p' "$baseline")
+  rows=$("$PSQL" -X -A -t -d "$BENCH_DB" -c "SELECT count(*) FROM $table")
+  base=
+
+  for function in format format_x; do
+    output=$("$PGBENCH" -n -T "$BENCH_TIME" -f "$dir/pgbench/$case-$function.sql" "$BENCH_DB")
+    tps=$(echo "$output" | sed -n 's/^tps = \([0-9.]*\).*/\1/p')
+    latency=$(echo "$output" | sed -n 's/^latency average = \([0-9.]*\) ms.*/\1/p')
+    base=${base:-$tps}
+
+    awk -v name="$case" -v fn="$function" -v tps="$tps" -v latency="$latency" \
+        -v rows="$rows" -v base="$base" 'BEGIN {
+      printf "%-12s %-10s %14.0f %14.3f %8.2f\n", name, fn, tps * rows, latency * 1000 / rows, tps / base
+    }'
+  done
+done
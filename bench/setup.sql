@@ -0,0 +1,55 @@
+-- Fixtures for the pgbench scripts in bench/pgbench, loaded by bench/run.sh
+--
+-- Every table but toasted has :rows rows; toasted has :rows / 100 rows of
+-- 64KB values stored out of line and uncompressed, so that formatting them
+-- includes fetching them from the TOAST table.
+
+CREATE EXTENSION IF NOT EXISTS format_x;
+CREATE EXTENSION IF NOT EXISTS hstore;
+
+DROP SCHEMA IF EXISTS format_x_bench CASCADE;
+CREATE SCHEMA format_x_bench;
+SET search_path = format_x_bench, public;
+
+CREATE TABLE nation(id INT, name TEXT, code TEXT, population INT);
+INSERT INTO nation
+  SELECT i, 'Nation ' || i, upper(substr(md5(i::TEXT), 1, 2)), i * 1000
+  FROM generate_series(1, :rows) i;
+
+CREATE TABLE document(id INT, data JSONB);
+INSERT INTO document
+  SELECT id, jsonb_build_object(
+    'name', name, 'code', code, 'population', population,
+    'capital', jsonb_build_object('name', 'City ' || id, 'code', code || '-C'),
+    'tags', jsonb_build_array('a', 'b', 'c'))
+  FROM nation;
+
+CREATE TABLE entry(id INT, data HSTORE);
+INSERT INTO entry
+  SELECT id, hstore(ARRAY['name', name, 'code', code, 'population', population::TEXT])
+  FROM nation;
+
+CREATE TABLE wide(
+  c1 INT, c2 TEXT, c3 INT, c4 TEXT, c5 INT, c6 TEXT, c7 INT, c8 TEXT, c9 INT, c10 TEXT,
+  c11 INT, c12 TEXT, c13 INT, c14 TEXT, c15 INT, c16 TEXT, c17 INT, c18 TEXT, c19 INT, c20 TEXT
+);
+INSERT INTO wide
+  SELECT i, md5(i::TEXT), i + 1, md5((i + 1)::TEXT), i + 2, md5((i + 2)::TEXT),
+         i + 3, md5((i + 3)::TEXT), i + 4, md5((i + 4)::TEXT), i + 5, md5((i + 5)::TEXT),
+         i + 6, md5((i + 6)::TEXT), i + 7, md5((i + 7)::TEXT), i + 8, md5((i + 8)::TEXT),
+         i + 9, md5((i + 9)::TEXT)
+  FROM generate_series(1, :rows) i;
+
+-- Labels of the same length in characters, ASCII and not (in a UTF-8 database)
+CREATE TABLE label(id INT, ascii TEXT, utf8 TEXT);
+INSERT INTO label
+  SELECT i, 'Nation number ' || i, 'Naçião número ' || i
+  FROM generate_series(1, :rows) i;
+
+CREATE TABLE toasted(id INT, body TEXT);
+ALTER TABLE toasted ALTER COLUMN body SET STORAGE EXTERNAL;
+INSERT INTO toasted
+  SELECT i, repeat(md5(i::TEXT), 2048)
+  FROM generate_series(1, greatest(:rows / 100, 1)) i;
+
+VACUUM ANALYZE nation, document, entry, wide, label, toasted;
@@ -1,12 +1,148 @@
 -- complain if script is sourced in psql, rather than via CREATE EXTENSION
 \echo Use "CREATE EXTENSION format_x" to load this file. \quit
 
+CREATE OR REPLACE FUNCTION format_x_support(internal)
+  RETURNS internal AS
+'format_x', 'format_x_support'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
 CREATE OR REPLACE FUNCTION format_x(string TEXT)
   RETURNS TEXT AS
 'format_x', 'format_x'
-LANGUAGE C IMMUTABLE;
+LANGUAGE C IMMUTABLE SUPPORT format_x_support;
 
 CREATE OR REPLACE FUNCTION format_x(string TEXT, VARIADIC "any")
   RETURNS TEXT AS
 'format_x', 'format_x'
-LANGUAGE C IMMUTABLE;
+LANGUAGE C IMMUTABLE SUPPORT format_x_support;
+
+CREATE TYPE format_template;
+
+CREATE OR REPLACE FUNCTION format_template_in(cstring)
+  RETURNS format_template AS
+'format_x', 'format_template_in'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION format_template_out(format_template)
+  RETURNS cstring AS
+'format_x', 'format_template_out'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION format_template_recv(internal)
+  RETURNS format_template AS
+'format_x', 'format_template_recv'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION format_template_send(format_template)
+  RETURNS bytea AS
+'format_x', 'format_template_send'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- The type category is left as user-defined so that an unknown literal
+-- still resolves to format_x(TEXT, ...)
+CREATE TYPE format_template (
+  INPUT = format_template_in,
+  OUTPUT = format_template_out,
+  RECEIVE = format_template_recv,
+  SEND = format_template_send,
+  INTERNALLENGTH = VARIABLE,
+  ALIGNMENT = int4,
+  STORAGE = extended
+);
+
+CREATE CAST (TEXT AS format_template) WITH INOUT AS ASSIGNMENT;
+CREATE CAST (format_template AS TEXT) WITH INOUT;
+
+CREATE OR REPLACE FUNCTION format_x(template format_template)
+  RETURNS TEXT AS
+'format_x', 'format_x_template'
+LANGUAGE C IMMUTABLE SUPPORT format_x_support;
+
+CREATE OR REPLACE FUNCTION format_x(template format_template, VARIADIC "any")
+  RETURNS TEXT AS
+'format_x', 'format_x_template'
+LANGUAGE C IMMUTABLE SUPPORT format_x_support;
+
+CREATE OR REPLACE FUNCTION format_x_each(string TEXT, args anyarray)
+  RETURNS TEXT[] AS
+'format_x', 'format_x_each'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION format_x_unnest(string TEXT, args anyarray)
+  RETURNS SETOF TEXT AS
+'format_x', 'format_x_unnest'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION format_x_table(string TEXT, rel regclass)
+  RETURNS SETOF TEXT AS
+'format_x', 'format_x_table'
+LANGUAGE C STABLE STRICT PARALLEL RESTRICTED;
+
+CREATE OR REPLACE FUNCTION format_x_exec(string TEXT)
+  RETURNS BIGINT AS
+'format_x', 'format_x_exec'
+LANGUAGE C VOLATILE PARALLEL UNSAFE;
+
+CREATE OR REPLACE FUNCTION format_x_exec(string TEXT, VARIADIC "any")
+  RETURNS BIGINT AS
+'format_x', 'format_x_exec'
+LANGUAGE C VOLATILE PARALLEL UNSAFE;
+
+CREATE OR REPLACE FUNCTION format_x_agg_transfn(internal, TEXT, TEXT, anyelement)
+  RETURNS internal AS
+'format_x', 'format_x_agg_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION format_x_agg_finalfn(internal)
+  RETURNS TEXT AS
+'format_x', 'format_x_agg_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION format_x_agg_combinefn(internal, internal)
+  RETURNS internal AS
+'format_x', 'format_x_agg_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION format_x_agg_serialfn(internal)
+  RETURNS bytea AS
+'format_x', 'format_x_agg_serialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION format_x_agg_deserialfn(bytea, internal)
+  RETURNS internal AS
+'format_x', 'format_x_agg_deserialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE AGGREGATE format_x_agg(string TEXT, separator TEXT, formatarg anyelement) (
+  SFUNC = format_x_agg_transfn,
+  STYPE = internal,
+  FINALFUNC = format_x_agg_finalfn,
+  COMBINEFUNC = format_x_agg_combinefn,
+  SERIALFUNC = format_x_agg_serialfn,
+  DESERIALFUNC = format_x_agg_deserialfn,
+  PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION format_x_stats(
+  OUT calls BIGINT,
+  OUT template_hits BIGINT,
+  OUT template_misses BIGINT,
+  OUT record_lookups BIGINT,
+  OUT jsonb_lookups BIGINT,
+  OUT json_lookups BIGINT,
+  OUT hstore_lookups BIGINT,
+  OUT array_lookups BIGINT,
+  OUT lookup_misses BIGINT,
+  OUT bytes BIGINT,
+  OUT compile_time FLOAT8,
+  OUT lookup_time FLOAT8,
+  OUT output_time FLOAT8,
+  OUT quote_time FLOAT8
+) RETURNS record AS
+'format_x', 'format_x_stats'
+LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+CREATE OR REPLACE FUNCTION format_x_stats_reset()
+  RETURNS void AS
+'format_x', 'format_x_stats_reset'
+LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
@@ -1 +1,21 @@
+DROP FUNCTION format_x_stats_reset();
+DROP FUNCTION format_x_stats();
+DROP AGGREGATE format_x_agg(TEXT, TEXT, anyelement);
+DROP FUNCTION format_x_agg_deserialfn(bytea, internal);
+DROP FUNCTION format_x_agg_serialfn(internal);
+DROP FUNCTION format_x_agg_combinefn(internal, internal);
+DROP FUNCTION format_x_agg_finalfn(internal);
+DROP FUNCTION format_x_agg_transfn(internal, TEXT, TEXT, anyelement);
+DROP FUNCTION format_x_exec(string TEXT, "any");
+DROP FUNCTION format_x_exec(string TEXT);
+DROP FUNCTION format_x_table(TEXT, regclass);
+DROP FUNCTION format_x_unnest(TEXT, anyarray);
+DROP FUNCTION format_x_each(TEXT, anyarray);
 DROP FUNCTION format_x(string TEXT, "any");
+DROP FUNCTION format_x(template format_template, "any");
+DROP FUNCTION format_x(template format_template);
+DROP CAST (format_template AS TEXT);
+DROP CAST (TEXT AS format_template);
+DROP TYPE format_template CASCADE;
+DROP FUNCTION format_x(string TEXT);
+DROP FUNCTION format_x_support(internal);
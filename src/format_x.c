@@ -2,25 +2,109 @@
 #include "fmgr.h"
 #include "utils/builtins.h"
 #include "lib/stringinfo.h"
+#include "libpq/pqformat.h" /* pq_begintypsend(), pq_getmsgint() */
 #include "hstore.h"
+#include "access/detoast.h" /* toast_raw_datum_size() */
+#include "access/genam.h" /* systable_beginscan() */
 #include "access/htup_details.h" /* HeapTupleHeader, HeapTupleHeaderGet*(), heap_getattr() */
+#include "access/table.h" /* table_open() */
+#include "access/tableam.h" /* table_beginscan(), table_scan_getnextslot(), table_slot_create() */
+#include "catalog/objectaddress.h" /* get_relkind_objtype() */
+#include "catalog/pg_class.h" /* RELKIND_RELATION, RELKIND_MATVIEW */
+#include "catalog/pg_extension.h" /* ExtensionRelationId, ExtensionNameIndexId */
 #include "catalog/pg_type.h" /* Oid constants */
+#include "common/hashfn.h" /* hash_bytes() */
+#include "common/int.h" /* pg_mul_s32_overflow(), pg_add_s32_overflow() */
+#include "common/jsonapi.h" /* makeJsonLexContextCstringLen(), json_lex() */
+#include "common/shortest_dec.h" /* float_to_shortest_decimal_buf(), double_to_shortest_decimal_buf() */
+#include "executor/tuptable.h" /* TupleTableSlot, slot_getattr() */
+#include "executor/executor.h" /* RegisterExprContextCallback() */
+#include "executor/spi.h" /* SPI_prepare_params(), SPI_keepplan(), SPI_execute_plan_with_paramlist() */
+#include "miscadmin.h" /* GetUserId() */
+#include "funcapi.h" /* SRF_FIRSTCALL_INIT() */
+#include "nodes/makefuncs.h" /* makeConst(), makeFuncExpr() */
+#include "nodes/nodeFuncs.h" /* exprType() */
+#include "nodes/params.h" /* makeParamList() */
+#include "nodes/supportnodes.h" /* SupportRequestSimplify, SupportRequestCost */
+#include "optimizer/optimizer.h" /* evaluate_expr(), cpu_operator_cost */
+#include "parser/parse_param.h" /* setup_parse_variable_parameters(), setup_parse_fixed_parameters() */
+#include "port/pg_bitutils.h" /* pg_leftmost_one_pos32() */
+#include "portability/instr_time.h" /* INSTR_TIME_SET_CURRENT(), INSTR_TIME_ACCUM_DIFF() */
+#include "utils/array.h" /* deconstruct_array(), construct_md_array() */
+#include "utils/arrayaccess.h" /* array_iter_setup(), array_iter_next() */
+#include "utils/datum.h" /* datumCopy() */
+#include "utils/fmgroids.h" /* F_NAMEEQ */
+#include "utils/guc.h" /* DefineCustomBoolVariable() */
+#include "utils/hsearch.h" /* hash_create(), hash_search() */
+#include "utils/inval.h" /* CacheRegisterSyscacheCallback() */
 #include "utils/jsonb.h"
+#include "utils/jsonfuncs.h" /* json_ereport_error() */
+#include "mb/pg_wchar.h" /* GetDatabaseEncoding() */
 #include "utils/lsyscache.h" /* getTypeOutputInfo(), type_is_rowtype() */
-#include "utils/typcache.h" /* lookup_rowtype_tupdesc() */
+#include "utils/memutils.h" /* MaxAllocSize */
+#include "utils/syscache.h" /* GetSysCacheOid2(), GetSysCacheHashValue1() */
+#include "utils/typcache.h" /* lookup_rowtype_tupdesc_copy() */
+#include "utils/acl.h" /* pg_class_aclcheck() */
+#include "utils/rel.h" /* RelationGetDescr(), RelationGetForm() */
+#include "utils/rls.h" /* check_enable_rls() */
+#include "utils/snapmgr.h" /* GetActiveSnapshot() */
 
 #ifdef PG_MODULE_MAGIC
 PG_MODULE_MAGIC;
 #endif
 
+void _PG_init(void);
+
 Datum format_x(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(format_x);
 
+Datum format_x_template(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_template);
+
+Datum format_template_in(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_template_in);
+Datum format_template_out(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_template_out);
+Datum format_template_recv(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_template_recv);
+Datum format_template_send(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_template_send);
+
+Datum format_x_support(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_support);
+
+Datum format_x_each(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_each);
+Datum format_x_unnest(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_unnest);
+
+Datum format_x_table(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_table);
+
+Datum format_x_exec(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_exec);
+
+Datum format_x_agg_transfn(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_agg_transfn);
+Datum format_x_agg_finalfn(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_agg_finalfn);
+Datum format_x_agg_combinefn(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_agg_combinefn);
+Datum format_x_agg_serialfn(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_agg_serialfn);
+Datum format_x_agg_deserialfn(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_agg_deserialfn);
+
+Datum format_x_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_stats);
+Datum format_x_stats_reset(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(format_x_stats_reset);
+
 typedef HStore *(*hstoreUpgradeF)(Datum);
 typedef int (*hstoreFindKeyF)(HStore *, int *, char *, int);
 
 /* This struct holds data about each format specifier in the format string */ 
-/* After processing and appending the result to the output buffer, it is overwritten by the next format specifier's data
+/* It is filled in by format_read_specifier() while compiling the format string
  * Note that the format string data is stored elsewhere */
 typedef struct {
   int parameter; // a 0 indicates no parameter
@@ -28,127 +112,1775 @@ typedef struct {
   int keylen; // a 0 keylen indicates no key
   bool flag;
   int width;
-  int precision;
+  int precision; // a -1 indicates no precision
   char type;
 } FormatSpecifierData;
 
-/* This struct holds both info about the format args */
-/* as well as the arg data in the case of a variadic argument */
-typedef struct {
-  // Variadic info
-  bool funcvariadic;
+/* One step of a compiled format string: either a run of literal text to be
+ * copied to the output or a format specifier with its parameter resolved */
+typedef struct {
+  char type; // '\0' for a literal run, otherwise the specifier type
+  bool flag;
+  int32 parameter;
+  int32 width;
+  int32 precision; // -1 if not given
+  int32 offset; // literal: offset of the run in the format string; specifier: index of its first key
+  int32 length; // literal: length of the run; specifier: number of keys
+} FormatInstructionData;
+
+/* A single key of a (dotted) key path; the key itself is null-terminated */
+typedef struct {
+  int32 offset; // from the start of the program
+  int32 length;
+} FormatKeyData;
+
+/* A compiled format string */
+/* The program is one position-independent chunk: the instructions are followed by
+ * the keys, the format string and the key strings, all referenced by offset.
+ * It starts with a varlena header so that it is also a format_template datum. */
+/* As format_template values are stored, the first four fields must never change:
+ * a program of another version is compiled again from its format string */
+typedef struct {
+  int32 vl_len_; // varlena header (do not touch directly!)
+  int32 version; // FORMAT_PROGRAM_VERSION when the program was compiled
+  int32 source_offset; // of the format string, from the start of the program
+  int32 source_length;
+  int32 ninstructions;
+  int32 nkeys;
+  int32 literal_length; // total length of the literal runs
+  FormatInstructionData instructions[FLEXIBLE_ARRAY_MEMBER];
+} FormatProgramData;
+
+/* Bump whenever the layout of a program past its first four fields changes */
+#define FORMAT_PROGRAM_VERSION 1
+
+#define FORMAT_PROGRAM_KEYS(program) \
+  ((FormatKeyData *) ((program)->instructions + (program)->ninstructions))
+#define FORMAT_PROGRAM_SOURCE(program) ((char *) (program) + (program)->source_offset)
+#define FORMAT_PROGRAM_STRING(program, offset) ((char *) (program) + (offset))
+
+/* A format_template is detoasted to a 4-byte header so that the program is aligned */
+#define DatumGetFormatProgramP(X) format_program_detoast(X)
+#define PG_GETARG_FORMAT_PROGRAM_P(n) DatumGetFormatProgramP(PG_GETARG_DATUM(n))
+
+/* An output function for a type, looked up once per call site */
+typedef struct {
+  Oid typid;
+  FmgrInfo typoutputfinfo;
+} FormatTypeOutputData;
+
+/* A key resolved against a row type */
+typedef struct {
+  char *key;
+  int keylen;
+  AttrNumber attnum;
+  Oid atttypid;
+} FormatAttributeData;
+
+/* A row type looked up in, with the keys resolved against it so far */
+/* The last row looked up in is kept in slot so that it is deformed only once for
+ * all the specifiers looking up in it; it is only valid for the call (generation)
+ * that stored it */
+typedef struct {
+  Oid tupType;
+  int32 tupTypmod;
+  TupleDesc tupdesc;
+
+  int nattributes;
+  int maxattributes;
+  FormatAttributeData *attributes;
+
+  TupleTableSlot *slot;
+  HeapTupleData tuple;
+  Datum datum;
+  uint64 generation;
+} FormatRecordData;
+
+/* This struct is kept in fn_extra so that it survives across calls from the same call site */
+/* Everything it points to is allocated in mcxt (the fn_mcxt of the call site) */
+typedef struct {
+  MemoryContext mcxt;
+
+  /* Lookups and conversions are done in this context, which is reset after every call */
+  MemoryContext scratch;
+
+  /* Incremented on every call */
+  uint64 generation;
+
+  FormatProgramData *program;
+
+  /* Argument types; resolved on the first call as they can't change afterwards */
+  bool argtypes_valid;
+  bool funcvariadic;
+  int nargtypes;
+  Oid *argtypes;
+  int16 *argtyplens;
+
+  /* Storage info for the element type of a variadic argument */
+  Oid element_type;
+  int16 elmlen;
+  bool elmbyval;
+  char elmalign;
+
+  /* Length of the last output, as rows from the same call site tend to be alike; only a hint
+   * for format_estimate_length() */
+  Size output_length;
+
+  /* Output functions of every type seen so far */
+  int ntypoutputs;
+  int maxtypoutputs;
+  FormatTypeOutputData *typoutputs;
+
+  /* Row types looked up in so far */
+  int nrecords;
+  int maxrecords;
+  FormatRecordData **records;
+} FormatCacheData;
+
+/* The %L values of a statement formatted by format_x_exec(), which become its parameters $1, $2, ... */
+typedef struct {
+  int nparams;
+  int maxparams;
+  char **values; // the values as strings, NULL for a null value or one passed as a Datum
+  Datum *datums; // the values passed as they are, which are of their parameter's type
+  bool *nulls;
+  Oid *types; // the types the values are passed as, InvalidOid for one typed from where it is used
+  MemoryContext mcxt; // where the values are copied to, as they outlive the call
+} FormatParamsData;
+
+/* This struct holds both info about the format args */
+/* as well as the arg data in the case of a variadic argument */
+typedef struct {
+  // Variadic info
+  bool funcvariadic;
+
+  int nargs;
+
+  FunctionCallInfo fcinfo;
+  int argoffset; // parameter n is argument argoffset + n of fcinfo
+
+  FormatCacheData *cache;
+
+  /* A VARIADIC array is not deconstructed: elements are fetched by format_variadic_get()
+   * only when a format specifier refers to them */
+  ArrayType *array;
+  array_iter iter; // the walk over the elements of array, when they can't be found by offset
+  int iter_index; // the index of the element iter returns next, -1 before the walk starts
+  Datum iter_value; // the element at iter_index - 1
+  bool iter_isnull;
+
+  /* The elements of an array formatted one at a time by format_x_each() and format_x_unnest() */
+  Datum *elements;
+  bool *nulls;
+  Oid element_type;
+
+  FormatProgramData *program; // the program being run
+  List *key_groups; // FormatKeyGroupData of the arguments looked up in so far
+
+  /* The row of the relation scanned by format_x_table(), which is the only argument
+   * and is looked up in straight from its slot */
+  TupleTableSlot *slot;
+  FormatRecordData *record;
+
+  FormatParamsData *params; // NULL unless %L values are made parameters by format_x_exec()
+} FormatargInfoData;
+
+/* What a statement run by format_x_exec() is kept by: its text and the types of its %L values */
+typedef struct {
+  char *sql;
+  int nparams;
+  Oid *types;
+} FormatPlanKeyData;
+
+/* A statement run by format_x_exec(), prepared with the types of its parameters */
+/* Statements are kept in format_plans, so that a statement formatted again later
+ * in the session, from any call site, is not planned again */
+typedef struct {
+  FormatPlanKeyData key;
+  SPIPlanPtr plan;
+  Oid *paramtypes; // the parameter types, once fixed by the first analysis
+  int nparamtypes;
+  bool analyzed; // the statement is analyzed again with paramtypes as they are
+  FmgrInfo *inputs; // the input functions of the parameter types
+  Oid *typioparams;
+  MemoryContext mcxt; // holds all of the above but the plan
+} FormatPlanData;
+
+typedef struct {
+  FormatPlanKeyData key; // points into plan
+  FormatPlanData *plan;
+} FormatPlanEntry;
+
+/* The most statements kept by format_x_exec(); statements formatted once the cache
+ * is full are planned on every call */
+#define FORMAT_MAX_PLANS 256
+
+static HTAB *format_plans = NULL;
+static MemoryContext format_plan_context = NULL;
+
+/* This struct holds what is needed to recognize and look up in hstore arguments */
+/* hstore's oid is not constant, so it is resolved once per backend and kept until
+ * a syscache callback reports that the hstore type (or, while hstore is not
+ * installed, any type) was created, altered or dropped */
+typedef struct {
+  bool valid;
+  Oid hstoreOid;
+  uint32 hstoreHash; // TYPEOID syscache hash value of hstoreOid
+  hstoreFindKeyF hstoreFindKey;
+  hstoreUpgradeF hstoreUpgrade;
+} HstoreCacheData;
+
+static HstoreCacheData hstore_cache = { .valid = false };
+static bool hstore_callback_registered = false;
+
+/* Counters of the work done by this backend, reported by format_x_stats() */
+typedef struct {
+  int64 calls; // strings formatted
+  int64 template_hits; // format strings found already compiled in the cache of a call site
+  int64 template_misses;
+  int64 record_lookups;
+  int64 jsonb_lookups;
+  int64 json_lookups;
+  int64 hstore_lookups;
+  int64 array_lookups;
+  int64 lookup_misses;
+  int64 bytes; // output produced
+  /* The time spent in each phase, only while format_x.track_timing is on */
+  instr_time compile_time;
+  instr_time lookup_time;
+  instr_time output_time; // converting values to strings
+  instr_time quote_time; // quoting %I and %L values
+} FormatStatsData;
+
+static FormatStatsData format_stats;
+
+/* format_x.track_timing */
+static bool format_track_timing = false;
+
+/* Start timing a phase into start, if format_x.track_timing is on */
+#define FORMAT_TIMING_START(start) do { \
+  if (format_track_timing) \
+    INSTR_TIME_SET_CURRENT(start); \
+  else \
+    INSTR_TIME_SET_ZERO(start); \
+} while (0)
+
+/* Add the time since start to the counter of a phase */
+#define FORMAT_TIMING_END(start, counter) do { \
+  if (format_track_timing) { \
+    instr_time end_; \
+    INSTR_TIME_SET_CURRENT(end_); \
+    INSTR_TIME_ACCUM_DIFF(format_stats.counter, end_, start); \
+  } \
+} while (0)
+
+/* This struct holds, eventually, the value to be written in place of a given format specifier in the output string. */
+/* It is created initially from the argument corresponding to that specifier. */
+/* A jsonb array or object found by a lookup into a jsonb is kept as a pointer to its
+ * container within the original jsonb (with typid JSONBOID) instead of being copied */
+typedef struct {
+  Datum item;
+  Oid typid;
+  bool isNull;
+  JsonbContainer *container; // NULL unless the object is a container within a jsonb
+  char *string; // NULL unless the object is text already available as string (not null-terminated)
+  int length; // the length of string
+  char *json; // NULL unless the object is a json object or array within a json, of length jsonlen
+  int jsonlen;
+  int parameter; // the parameter the object is, 0 once something has been looked up in it
+} Object;
+
+/* All the keys the program looks up first in a json, jsonb or hstore argument,
+ * resolved together the first time one of them is looked up during a call */
+typedef struct {
+  int parameter;
+  int nkeys;
+  char **keys; // the keys, pointing into the program, sorted by format_key_compare()
+  int *keylens;
+  Object *objects; // what each key resolves to
+  bool *found;
+} FormatKeyGroupData;
+
+#define JSON_IS_WHITESPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+/* Enough for the output of any type that format_value() writes into a buffer */
+#define FORMAT_VALUE_BUFLEN 32
+
+/* Exponents beyond this are not applied by format_round_decimal(); numeric's own range
+ * is far smaller, but json numbers are unbounded */
+#define FORMAT_MAX_EXPONENT 1000000
+
+/* Read contiguous digits as a decimal number */
+static bool format_read_digits(char **cpp, char *endp, int *number, bool *invalid);
+
+/* Read a format specifier (generally following the SUS printf specification) */
+static char *format_read_specifier(char *cp, char *endp, FormatSpecifierData *spec, bool *invalid);
+
+/* Compile a format string into a program allocated in mcxt */
+static FormatProgramData *format_compile(char *startp, char *endp, MemoryContext mcxt, bool *invalid);
+
+/* Detoast a format_template, compiling it again if it was compiled by another version */
+static FormatProgramData *format_program_detoast(Datum datum);
+
+/* Return the cache kept in fn_extra, creating it on the first call */
+static FormatCacheData *format_cache_get(FmgrInfo *flinfo);
+
+/* Create an empty cache in mcxt */
+static FormatCacheData *format_cache_create(MemoryContext mcxt);
+
+/* Start a call: switch to the (reset) scratch context and return the previous context */
+static MemoryContext format_call_begin(FormatCacheData *cache);
+
+/* End a call: switch back to oldcontext and reset the scratch context */
+static void format_call_end(FormatCacheData *cache, MemoryContext oldcontext);
+
+/* Run the program, appending the formatted arguments to output */
+static void format_render(FormatProgramData *program, StringInfoData *output, FormatargInfoData *arginfodata);
+
+/* Run the program into a text allocated in oldcontext and end the call started by format_call_begin() */
+static text *format_run(FormatProgramData *program, FormatargInfoData *arginfodata, MemoryContext oldcontext);
+
+/* Format an array element as the only argument, returning a text allocated in the current context */
+static text *format_element(FormatCacheData *cache, FormatProgramData *program, FunctionCallInfo fcinfo,
+                            Datum *element, bool *isnull, Oid element_type);
+
+/* End the scan of format_x_table(), if it was not run to completion */
+static void format_table_shutdown(Datum arg);
+
+/* Append a parameter reference for a %L value to output, keeping the value as the parameter:
+ * val as a string, or the Datum of object itself when val is NULL */
+static void format_append_param(StringInfoData *output, FormatParamsData *params, Object *object, char *val, int vallen, Oid type);
+
+/* Return the prepared statement for sql and the types of its %L values, preparing it if it isn't kept yet; SPI must be connected */
+static FormatPlanData *format_plan_get(char *sql, FormatParamsData *params);
+
+/* Set up the parameters of a statement being analyzed for format_plan_get() */
+static void format_plan_parser_setup(ParseState *pstate, void *arg);
+
+/* Hash and compare the keys of format_plans, which are FormatPlanKeyData */
+static uint32 format_plan_hash(const void *key, Size keysize);
+static int format_plan_match(const void *key1, const void *key2, Size keysize);
+
+/* Extract all the elements of an array, caching the element type's storage info */
+static void format_array_deconstruct(FormatCacheData *cache, ArrayType *arr, Datum **elements, bool **nulls, int *nitems);
+
+/* Cache the storage info of an array element type, unless it's the same as last time */
+static void format_element_storage(FormatCacheData *cache, Oid element_type);
+
+/* Return the variadic element at index (counting from 0) */
+static Datum format_variadic_get(FormatargInfoData *arginfodata, int index, bool *isNull);
+
+/* Return a simpler call with the arguments that are constants formatted into the format string, or NULL */
+static Node *format_simplify(FuncExpr *expr);
+
+/* Whether a constant formatted by instruction gives the same text whatever the settings are */
+static bool format_simplify_stable(FormatInstructionData *instruction, Const *arg);
+
+/* Estimate the cost of a call from its program, returning false if the format string isn't a constant */
+static bool format_estimate_cost(FuncExpr *expr, Cost *cost);
+
+/* Append a format specifier for instruction that refers to the given parameter */
+static void format_append_specifier(StringInfo buf, FormatProgramData *program, FormatInstructionData *instruction, int parameter);
+
+/* Append string, doubling each '%' so that it is literal text in a format string */
+static void format_append_escaped(StringInfo buf, char *string, int length);
+
+/* Return the program for the format string, compiling it only if it changed since the last call */
+static FormatProgramData *format_program_get(FormatCacheData *cache, char *startp, int length);
+
+/* Return the output function for typid, looking it up only the first time typid is seen */
+static FmgrInfo *format_typoutput_get(FormatCacheData *cache, Oid typid);
+
+/* Estimate the length of the output from the literal text and the argument sizes */
+static Size format_estimate_length(FormatProgramData *program, FormatargInfoData *arginfodata);
+
+/* Initialize output, allocated in mcxt, with room for estimate bytes after a varlena header */
+static void format_output_init(StringInfoData *output, Size estimate, MemoryContext mcxt);
+
+/* Returns a formatted string when provided with named arguments */
+void format_engine(FormatProgramData *program, FormatInstructionData *instruction, StringInfoData *output, FormatargInfoData *arginfodata);
+
+/* Lookup an attribute by key (with length keylen) in object */
+/* The result and result type is returned by rewriting members of object */
+void format_lookup(Object *object, FormatargInfoData *arginfodata, char *key, int keylen);
+void record_lookup(Object *object, FormatargInfoData *arginfodata, char *key, int keylen);
+void jsonb_lookup(Object *object, char *key, int keylen);
+void json_lookup(Object *object, char *key, int keylen);
+void hstore_lookup(Object *object, char *key, int keylen);
+void array_lookup(Object *object, char *key, int keylen);
+
+/* Parse a key of only digits as an array index */
+static bool format_key_index(char *key, int keylen, int *index);
+
+/* Report a key that does not exist in the object it is looked up in */
+static void format_key_missing(char *key, int keylen) pg_attribute_noreturn();
+
+/* Look up a first key in a json, jsonb or hstore argument through the key group of the argument */
+static void format_group_lookup(Object *object, FormatargInfoData *arginfodata, char *key, int keylen);
+
+/* Return the key group of the argument object is, resolving it the first time during a call */
+static FormatKeyGroupData *format_key_group_get(FormatargInfoData *arginfodata, Object *object);
+
+/* Order keys by length and then bytes, the order of jsonb object keys and hstore keys */
+static int format_key_compare(char *key1, int keylen1, char *key2, int keylen2);
+
+/* Return the index of key among nkeys keys sorted by format_key_compare(), or -1 */
+static int format_key_find(char **keys, int *keylens, int nkeys, char *key, int keylen);
+
+/* Whether a walk over all count entries is cheaper than nkeys binary searches */
+static bool format_key_group_walk(int nkeys, int count);
+
+/* Resolve the keys of group in a jsonb container, hstore or json text */
+static void jsonb_resolve_keys(FormatKeyGroupData *group, JsonbContainer *container);
+static void hstore_resolve_keys(FormatKeyGroupData *group, HStore *hs);
+static void json_resolve_keys(FormatKeyGroupData *group, char *json, int jsonlen);
+
+/* Set object to a jsonb value, a value of an hstore or a json value given as text */
+static void jsonb_set_value(Object *object, JsonbValue *v);
+static void hstore_set_value(Object *object, HStore *hs, int idx);
+static void json_set_value(Object *object, char *value, int valuelen);
+
+/* Scan the json object for the values of nkeys keys (sorted by format_key_compare()),
+ * taking the last value of a key that appears more than once */
+static void json_scan_object(char *cp, char *endp, int nkeys, char **keys, int *keylens, char **values, int *valuelens);
+
+/* Scan the json array for its element at index */
+static void json_scan_array(char *cp, char *endp, int index, char **value, int *valuelen);
+
+/* Convert a (not null) object to a string, without a type output function call for common builtin types */
+static char *format_value(Object *object, FormatCacheData *cache, char *buf, int *length);
+
+/* Convert a (not null) object to a string of at most precision characters */
+static char *format_value_prefix(Object *object, int precision, FormatCacheData *cache, char *buf, int *length);
+
+/* Convert a (not null) float or numeric object to a string with precision digits after the radix character */
+static char *format_fixed(Object *object, int precision, char *buf, int *length);
+
+/* Round a decimal number, possibly with an exponent, to precision digits after the radix character */
+static char *format_round_decimal(char *string, int strlength, int precision, char *buf, int *length);
+
+/* Return the number of characters in string, which is what width counts */
+static int format_char_length(char *string, int length);
+
+/* Whether string is all ASCII, checking a word at a time */
+static bool format_is_ascii(char *string, int length);
+
+/* Parse the optional portions of the format specifier */
+char *option_format(StringInfoData *output, char *string, int length, int width, bool align_to_left);
+
+/* Quote string as an SQL identifier (as quote_identifier() would) or literal (as quote_literal() would)
+ * straight into output, padded to width according to the quoted length */
+static void format_append_identifier(StringInfoData *output, char *string, int length, int width, bool align_to_left);
+static void format_append_literal(StringInfoData *output, char *string, int length, int width, bool align_to_left);
+
+/* Populate FormatargInfoData from FunctionCallInfo, where parameter n is argument argoffset + n; copied from text_format() */
+void make_argument_data(FormatargInfoData *arginfodata, FunctionCallInfo fcinfo, int argoffset);
+
+/* Consume an FormatargInfoData and a position and return the datum at that position */
+Datum getarg(FormatargInfoData *arginfodata, int parameter, Oid *typid, bool *isNull);
+
+/* Check if typid belongs to hstore as hstore's oid is not constant */
+bool is_hstore(Oid typid);
+
+/* Resolve hstore's oid and functions, if hstore is installed */
+static void hstore_cache_resolve(void);
+
+/* Syscache callback invalidating hstore_cache */
+static void hstore_cache_callback(Datum arg, int cacheid, uint32 hashvalue);
+
+/* fillJsonbValue() is static and must be copied here */
+static void fillJsonbValue(JsonbContainer *container, int index,
+                           char *base_addr, uint32 offset,
+                           JsonbValue *result);
+
+/* findJsonbValueFromContainerLen() is static and must be copied here */
+/* findJsonbValueFromContainerLen() is a findJsonbValueFromContainer() wrapper that sets up JsonbValue key string. */
+static JsonbValue *findJsonbValueFromContainerLen(JsonbContainer *container,
+                                                           uint32 flags,
+                                                           char *key,
+                                                           uint32 keylen);
+
+/* Return the cached data for a row type, creating it the first time the row type is seen */
+static FormatRecordData *format_record_get(FormatCacheData *cache, Oid tupType, int32 tupTypmod);
+
+/* Resolve a key to an attribute of a row type; GetAttributeByName() does not provide typid */
+static FormatAttributeData *format_attribute_get(FormatCacheData *cache, FormatRecordData *record, char *key, int keylen);
+
+/* Report a malformed format string, unless invalid is given: then only set *invalid
+ * and return failure, as the planner must not fail on a call that may never run */
+#define FORMAT_SYNTAX_ERROR(invalid, failure, rest) do { \
+  if ((invalid) != NULL) { \
+    *(invalid) = true; \
+    return (failure); \
+  } \
+  ereport(ERROR, rest); \
+} while (0)
+
+#define ADVANCE_READ_POINTER(cp, endp, invalid, failure) do { \
+  if (++(cp) >= (endp)) \
+    FORMAT_SYNTAX_ERROR(invalid, failure, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), \
+		    errmsg("unterminated format_x() type specifier"), \
+		    errhint("For a single \"%%\" use \"%%%%\"."))); \
+} while (0)
+
+void _PG_init(void) {
+  DefineCustomBoolVariable("format_x.track_timing",
+                           "Collects the time spent in each phase of formatting for format_x_stats().",
+                           NULL,
+                           &format_track_timing,
+                           false,
+                           PGC_USERSET,
+                           0,
+                           NULL,
+                           NULL,
+                           NULL);
+
+  MarkGUCPrefixReserved("format_x");
+}
+
+Datum format_x(PG_FUNCTION_ARGS) {
+  text *format_string_text;
+  FormatProgramData *program;
+  FormatargInfoData arginfodata = {
+    .fcinfo = fcinfo };
+  MemoryContext oldcontext;
+
+  /* When format string is null, immediately return null */
+  if (PG_ARGISNULL(0))
+    PG_RETURN_NULL();
+
+  arginfodata.cache = format_cache_get(fcinfo->flinfo);
+  oldcontext = format_call_begin(arginfodata.cache);
+
+  make_argument_data(&arginfodata, fcinfo, 0);
+
+  format_string_text = PG_GETARG_TEXT_PP(0);
+  program = format_program_get(arginfodata.cache, VARDATA_ANY(format_string_text),
+                               VARSIZE_ANY_EXHDR(format_string_text));
+
+  PG_RETURN_TEXT_P(format_run(program, &arginfodata, oldcontext));
+}
+
+/*
+ * format_x(template, ...) is format_x() with a format_template, which is
+ * already compiled, so the format string is never parsed again.
+ */
+Datum format_x_template(PG_FUNCTION_ARGS) {
+  FormatProgramData *program;
+  FormatargInfoData arginfodata = {
+    .fcinfo = fcinfo };
+  MemoryContext oldcontext;
+
+  /* When template is null, immediately return null */
+  if (PG_ARGISNULL(0))
+    PG_RETURN_NULL();
+
+  arginfodata.cache = format_cache_get(fcinfo->flinfo);
+  oldcontext = format_call_begin(arginfodata.cache);
+
+  make_argument_data(&arginfodata, fcinfo, 0);
+
+  /* Any copy made by detoasting is in the scratch context */
+  program = PG_GETARG_FORMAT_PROGRAM_P(0);
+
+  PG_RETURN_TEXT_P(format_run(program, &arginfodata, oldcontext));
+}
+
+static text *format_run(FormatProgramData *program, FormatargInfoData *arginfodata, MemoryContext oldcontext) {
+  FormatCacheData *cache = arginfodata->cache;
+  StringInfoData output;
+
+  /* The output is built right after a varlena header so that it can be returned as is */
+  format_output_init(&output, format_estimate_length(program, arginfodata), oldcontext);
+  format_render(program, &output, arginfodata);
+
+  cache->output_length = output.len - VARHDRSZ;
+
+  format_call_end(cache, oldcontext);
+
+  SET_VARSIZE(output.data, output.len);
+  return (text *) output.data;
+}
+
+/*
+ * The format_template type is a compiled format string: the input function
+ * compiles it, so a malformed format string is rejected when the template is
+ * created, and the output function returns the original format string.
+ */
+Datum format_template_in(PG_FUNCTION_ARGS) {
+  char *string = PG_GETARG_CSTRING(0);
+
+  PG_RETURN_POINTER(format_compile(string, string + strlen(string), CurrentMemoryContext, NULL));
+}
+
+/* The output and send functions only read the format string, which is found the same way in every version */
+Datum format_template_out(PG_FUNCTION_ARGS) {
+  FormatProgramData *program = (FormatProgramData *) PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+
+  PG_RETURN_CSTRING(pnstrdup(FORMAT_PROGRAM_SOURCE(program), program->source_length));
+}
+
+/* The binary representation is the format string, so it is compiled again on receipt */
+Datum format_template_recv(PG_FUNCTION_ARGS) {
+  StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+  char *string;
+  int nbytes;
+
+  string = pq_getmsgtext(buf, buf->len - buf->cursor, &nbytes);
+  PG_RETURN_POINTER(format_compile(string, string + nbytes, CurrentMemoryContext, NULL));
+}
+
+Datum format_template_send(PG_FUNCTION_ARGS) {
+  FormatProgramData *program = (FormatProgramData *) PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+  StringInfoData buf;
+
+  pq_begintypsend(&buf);
+  pq_sendtext(&buf, FORMAT_PROGRAM_SOURCE(program), program->source_length);
+  PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+static void format_render(FormatProgramData *program, StringInfoData *output, FormatargInfoData *arginfodata) {
+  int start = output->len;
+
+  arginfodata->program = program;
+  arginfodata->key_groups = NIL;
+
+  for (int i = 0; i < program->ninstructions; i++) {
+    FormatInstructionData *instruction = &program->instructions[i];
+
+    /* Literal runs are copied to output as is */
+    if (instruction->type == '\0') {
+      appendBinaryStringInfo(output, FORMAT_PROGRAM_SOURCE(program) + instruction->offset, instruction->length);
+      continue;
+    }
+
+    format_engine(program, instruction, output, arginfodata);
+  }
+
+  format_stats.calls++;
+  format_stats.bytes += output->len - start;
+}
+
+static text *format_element(FormatCacheData *cache, FormatProgramData *program, FunctionCallInfo fcinfo,
+                            Datum *element, bool *isnull, Oid element_type) {
+  FormatargInfoData arginfodata = {
+    .fcinfo = fcinfo,
+    .cache = cache,
+    .funcvariadic = true,
+    .nargs = 2,
+    .elements = element,
+    .nulls = isnull,
+    .element_type = element_type };
+
+  return format_run(program, &arginfodata, format_call_begin(cache));
+}
+
+/*
+ * Planner support function for format_x().
+ *
+ * SupportRequestSimplify formats the arguments that are constants into the
+ * format string when the others aren't (when they all are the call is folded
+ * like any other immutable function call). SupportRequestCost charges for
+ * each format specifier and each lookup instead of the flat procost.
+ */
+Datum format_x_support(PG_FUNCTION_ARGS) {
+  Node *rawreq = (Node *) PG_GETARG_POINTER(0);
+  Node *ret = NULL;
+
+  if (IsA(rawreq, SupportRequestSimplify)) {
+    SupportRequestSimplify *req = (SupportRequestSimplify *) rawreq;
+
+    ret = format_simplify(req->fcall);
+  }
+  else if (IsA(rawreq, SupportRequestCost)) {
+    SupportRequestCost *req = (SupportRequestCost *) rawreq;
+    Cost cost;
+
+    if (req->node != NULL && IsA(req->node, FuncExpr) &&
+        format_estimate_cost((FuncExpr *) req->node, &cost)) {
+      req->startup = 0;
+      req->per_tuple = cost * cpu_operator_cost;
+      ret = (Node *) req;
+    }
+  }
+
+  PG_RETURN_POINTER(ret);
+}
+
+static Node *format_simplify(FuncExpr *expr) {
+  List *args = expr->args;
+  int nargs = list_length(args);
+  List *newargs = NIL;
+  bool *foldable;
+  int *parameters;
+  Const *format_const;
+  text *format_string_text;
+  FormatProgramData *program;
+  StringInfoData buf;
+  FuncExpr *newexpr;
+  bool invalid = false;
+
+  /* Only format_x(TEXT, ...) with its arguments spelled out can be rewritten */
+  if (expr->funcvariadic || nargs < 2 ||
+      !IsA(linitial(args), Const) || exprType(linitial(args)) != TEXTOID)
+    return NULL;
+
+  format_const = (Const *) linitial(args);
+  if (format_const->constisnull)
+    return NULL;
+
+  /* A malformed format string is left to be reported when the call is run, if it ever is */
+  format_string_text = DatumGetTextPP(format_const->constvalue);
+  program = format_compile(VARDATA_ANY(format_string_text),
+                           VARDATA_ANY(format_string_text) + VARSIZE_ANY_EXHDR(format_string_text),
+                           CurrentMemoryContext, &invalid);
+  if (program == NULL)
+    return NULL;
+
+  /* A constant is only formatted ahead of time if every format specifier
+   * using it gives the same text under any setting, as the plan may be kept
+   * and run after a SET */
+  foldable = palloc0(nargs * sizeof(bool));
+  for (int i = 1; i < nargs; i++)
+    foldable[i] = IsA(list_nth(args, i), Const);
+  for (int i = 0; i < program->ninstructions; i++) {
+    FormatInstructionData *instruction = &program->instructions[i];
+
+    if (instruction->type != '\0' && instruction->parameter < nargs && foldable[instruction->parameter] &&
+        !format_simplify_stable(instruction, (Const *) list_nth(args, instruction->parameter)))
+      foldable[instruction->parameter] = false;
+  }
+
+  /* Renumber the arguments that are kept; the ones that aren't constants are
+   * all kept, even if the format string doesn't use them, as they might have
+   * side effects */
+  parameters = palloc0(nargs * sizeof(int));
+  for (int i = 1; i < nargs; i++) {
+    if (!foldable[i]) {
+      newargs = lappend(newargs, list_nth(args, i));
+      parameters[i] = list_length(newargs);
+    }
+  }
+
+  if (newargs == NIL || list_length(newargs) == nargs - 1)
+    return NULL;
+
+  initStringInfo(&buf);
+  for (int i = 0; i < program->ninstructions; i++) {
+    FormatInstructionData *instruction = &program->instructions[i];
+    int parameter = instruction->parameter;
+    Const *arg;
+    StringInfoData specifier;
+    FuncExpr *call;
+    Const *result;
+    text *result_text;
+
+    if (instruction->type == '\0') {
+      format_append_escaped(&buf, FORMAT_PROGRAM_SOURCE(program) + instruction->offset, instruction->length);
+      continue;
+    }
+
+    /* Leave the error to be raised when the call is run */
+    if (parameter >= nargs)
+      return NULL;
+
+    if (parameters[parameter] > 0) {
+      format_append_specifier(&buf, program, instruction, parameters[parameter]);
+      continue;
+    }
+
+    /* Likewise for the null values that can't be formatted */
+    arg = (Const *) list_nth(args, parameter);
+    if (arg->constisnull && (instruction->type == 'I' || instruction->length > 0))
+      return NULL;
+
+    /* Run the format specifier alone against the constant */
+    initStringInfo(&specifier);
+    format_append_specifier(&specifier, program, instruction, 1);
+
+    call = makeFuncExpr(expr->funcid, TEXTOID,
+                        list_make2(makeConst(TEXTOID, -1, format_const->constcollid, -1,
+                                             PointerGetDatum(cstring_to_text_with_len(specifier.data, specifier.len)),
+                                             false, false),
+                                   arg),
+                        expr->funccollid, expr->inputcollid, COERCE_EXPLICIT_CALL);
+    result = (Const *) evaluate_expr((Expr *) call, TEXTOID, -1, expr->funccollid);
+
+    result_text = DatumGetTextPP(result->constvalue);
+    format_append_escaped(&buf, VARDATA_ANY(result_text), VARSIZE_ANY_EXHDR(result_text));
+  }
+
+  newexpr = makeFuncExpr(expr->funcid, expr->funcresulttype,
+                         lcons(makeConst(TEXTOID, -1, format_const->constcollid, -1,
+                                         PointerGetDatum(cstring_to_text_with_len(buf.data, buf.len)),
+                                         false, false),
+                               newargs),
+                         expr->funccollid, expr->inputcollid, expr->funcformat);
+  newexpr->location = expr->location;
+
+  return (Node *) newexpr;
+}
+
+static bool format_simplify_stable(FormatInstructionData *instruction, Const *arg) {
+  /* %I quotes every identifier when quote_all_identifiers is on */
+  if (instruction->type == 'I')
+    return false;
+
+  if (arg->constisnull)
+    return true;
+
+  /* Neither these nor the values looked up in them are output according to a setting */
+  if (arg->consttype == JSONBOID || arg->consttype == JSONOID || is_hstore(arg->consttype))
+    return true;
+
+  /* The attributes of a record can be of any type */
+  if (instruction->length > 0)
+    return false;
+
+  /* Unlike dates and times (DateStyle), floats (extra_float_digits) or bytea (bytea_output) */
+  switch (arg->consttype) {
+    case UNKNOWNOID:
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID:
+    case NAMEOID:
+    case INT2OID:
+    case INT4OID:
+    case INT8OID:
+    case NUMERICOID:
+    case BOOLOID:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* Costs are in units of cpu_operator_cost */
+#define FORMAT_COST_CALL 1.0
+#define FORMAT_COST_SPECIFIER 1.0
+#define FORMAT_COST_QUOTE 0.5
+#define FORMAT_COST_RECORD_LOOKUP 1.0
+#define FORMAT_COST_JSONB_LOOKUP 2.0
+#define FORMAT_COST_OTHER_LOOKUP 3.0
+
+static bool format_estimate_cost(FuncExpr *expr, Cost *cost) {
+  Const *format_const;
+  FormatProgramData *program;
+  bool invalid = false;
+
+  if (!IsA(linitial(expr->args), Const))
+    return false;
+
+  format_const = (Const *) linitial(expr->args);
+  if (format_const->constisnull)
+    return false;
+
+  if (exprType((Node *) format_const) == TEXTOID) {
+    text *format_string_text = DatumGetTextPP(format_const->constvalue);
+
+    program = format_compile(VARDATA_ANY(format_string_text),
+                             VARDATA_ANY(format_string_text) + VARSIZE_ANY_EXHDR(format_string_text),
+                             CurrentMemoryContext, &invalid);
+    if (program == NULL)
+      return false;
+  }
+  else
+    program = DatumGetFormatProgramP(format_const->constvalue);
+
+  *cost = FORMAT_COST_CALL;
+  for (int i = 0; i < program->ninstructions; i++) {
+    FormatInstructionData *instruction = &program->instructions[i];
+    Oid typid = InvalidOid;
+    Cost lookup_cost;
+
+    if (instruction->type == '\0')
+      continue;
+
+    *cost += FORMAT_COST_SPECIFIER;
+    if (instruction->type != 's')
+      *cost += FORMAT_COST_QUOTE;
+
+    if (instruction->length == 0)
+      continue;
+
+    /* Keys after the first are looked up in values of unknown type, so they
+     * are charged like the first */
+    if (expr->funcvariadic)
+      typid = get_base_element_type(exprType(lsecond(expr->args)));
+    else if (instruction->parameter < list_length(expr->args))
+      typid = exprType(list_nth(expr->args, instruction->parameter));
+
+    if (typid == JSONBOID)
+      lookup_cost = FORMAT_COST_JSONB_LOOKUP;
+    else if (OidIsValid(typid) && type_is_rowtype(typid))
+      lookup_cost = FORMAT_COST_RECORD_LOOKUP;
+    else
+      lookup_cost = FORMAT_COST_OTHER_LOOKUP;
+
+    *cost += instruction->length * lookup_cost;
+  }
+
+  return true;
+}
+
+static void format_append_specifier(StringInfo buf, FormatProgramData *program, FormatInstructionData *instruction, int parameter) {
+  FormatKeyData *keys = FORMAT_PROGRAM_KEYS(program) + instruction->offset;
+
+  appendStringInfo(buf, "%%%d", parameter);
+
+  if (instruction->length == 0)
+    appendStringInfoChar(buf, '$');
+  else {
+    appendStringInfoChar(buf, '(');
+    for (int i = 0; i < instruction->length; i++) {
+      if (i > 0)
+        appendStringInfoChar(buf, '.');
+      appendBinaryStringInfo(buf, FORMAT_PROGRAM_STRING(program, keys[i].offset), keys[i].length);
+    }
+    appendStringInfoChar(buf, ')');
+  }
+
+  if (instruction->flag)
+    appendStringInfoChar(buf, '-');
+  if (instruction->width > 0)
+    appendStringInfo(buf, "%d", instruction->width);
+  if (instruction->precision >= 0)
+    appendStringInfo(buf, ".%d", instruction->precision);
+  appendStringInfoChar(buf, instruction->type);
+}
+
+static void format_append_escaped(StringInfo buf, char *string, int length) {
+  char *endp = string + length;
+  char *cp;
+
+  while ((cp = memchr(string, '%', endp - string)) != NULL) {
+    appendBinaryStringInfo(buf, string, cp + 1 - string);
+    appendStringInfoChar(buf, '%');
+    string = cp + 1;
+  }
+  appendBinaryStringInfo(buf, string, endp - string);
+}
+
+/*
+ * format_x_each(string, args) formats every element of args as if it were the
+ * only argument of format_x(string, element), and returns the results as a
+ * text array with the same dimensions as args.
+ *
+ * The format string is compiled once and the lookup caches are shared by all
+ * elements; the scratch context is reset after each element.
+ */
+Datum format_x_each(PG_FUNCTION_ARGS) {
+  FormatCacheData *cache = format_cache_get(fcinfo->flinfo);
+  text *format_string_text = PG_GETARG_TEXT_PP(0);
+  ArrayType *arr = PG_GETARG_ARRAYTYPE_P(1);
+  FormatProgramData *program;
+  Datum *elements;
+  bool *nulls;
+  Datum *results;
+  int nitems;
+  ArrayType *result;
+
+  program = format_program_get(cache, VARDATA_ANY(format_string_text),
+                               VARSIZE_ANY_EXHDR(format_string_text));
+
+  if (ARR_NDIM(arr) == 0)
+    PG_RETURN_ARRAYTYPE_P(construct_empty_array(TEXTOID));
+
+  format_array_deconstruct(cache, arr, &elements, &nulls, &nitems);
+
+  results = palloc(nitems * sizeof(Datum));
+  for (int i = 0; i < nitems; i++)
+    results[i] = PointerGetDatum(format_element(cache, program, fcinfo, &elements[i], &nulls[i], ARR_ELEMTYPE(arr)));
+
+  result = construct_md_array(results, NULL, ARR_NDIM(arr), ARR_DIMS(arr), ARR_LBOUND(arr),
+                              TEXTOID, -1, false, TYPALIGN_INT);
+
+  for (int i = 0; i < nitems; i++)
+    pfree(DatumGetPointer(results[i]));
+  pfree(results);
+
+  PG_RETURN_ARRAYTYPE_P(result);
+}
+
+/* The state of format_x_unnest() across calls */
+typedef struct {
+  FormatCacheData *cache;
+  FormatProgramData *program;
+  Datum *elements;
+  bool *nulls;
+  int nitems;
+  Oid element_type;
+} FormatUnnestData;
+
+/*
+ * format_x_unnest(string, args) is the set-returning variant of
+ * format_x_each(), returning one row per element of args.
+ *
+ * fn_extra belongs to the SRF machinery here, so the cache lives in the
+ * multi-call context and is only shared by the elements of one array.
+ */
+Datum format_x_unnest(PG_FUNCTION_ARGS) {
+  FuncCallContext *funcctx;
+  FormatUnnestData *unnest;
+
+  if (SRF_IS_FIRSTCALL()) {
+    MemoryContext oldcontext;
+    text *format_string_text;
+    ArrayType *arr;
+
+    funcctx = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    unnest = palloc0(sizeof(FormatUnnestData));
+    unnest->cache = format_cache_create(funcctx->multi_call_memory_ctx);
+
+    format_string_text = PG_GETARG_TEXT_PP(0);
+    unnest->program = format_program_get(unnest->cache, VARDATA_ANY(format_string_text),
+                                         VARSIZE_ANY_EXHDR(format_string_text));
+
+    arr = PG_GETARG_ARRAYTYPE_P(1);
+    unnest->element_type = ARR_ELEMTYPE(arr);
+    if (ARR_NDIM(arr) > 0)
+      format_array_deconstruct(unnest->cache, arr, &unnest->elements, &unnest->nulls, &unnest->nitems);
+
+    funcctx->user_fctx = unnest;
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  unnest = (FormatUnnestData *) funcctx->user_fctx;
+
+  if (funcctx->call_cntr < unnest->nitems) {
+    int i = funcctx->call_cntr;
+    text *result = format_element(unnest->cache, unnest->program, fcinfo,
+                                  &unnest->elements[i], &unnest->nulls[i], unnest->element_type);
+
+    SRF_RETURN_NEXT(funcctx, PointerGetDatum(result));
+  }
+
+  SRF_RETURN_DONE(funcctx);
+}
+
+/* The state of format_x_table() across calls */
+typedef struct {
+  FormatCacheData *cache;
+  FormatProgramData *program;
+  Relation rel;
+  TableScanDesc scan; // NULL once the scan has ended
+  TupleTableSlot *slot;
+  FormatRecordData *record;
+} FormatTableData;
+
+/*
+ * Format every row of a relation, scanning it directly rather than taking
+ * whole-row datums as format_x() does, so that each row is only deformed as
+ * far as the columns the format string looks up. Rows are returned one per
+ * call and nothing is kept from one row to the next.
+ */
+Datum format_x_table(PG_FUNCTION_ARGS) {
+  FuncCallContext *funcctx;
+  FormatTableData *table;
+
+  if (SRF_IS_FIRSTCALL()) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    MemoryContext oldcontext;
+    text *format_string_text;
+    Oid relid = PG_GETARG_OID(1);
+    AclResult aclresult;
+
+    funcctx = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    table = palloc0(sizeof(FormatTableData));
+    table->cache = format_cache_create(funcctx->multi_call_memory_ctx);
+
+    format_string_text = PG_GETARG_TEXT_PP(0);
+    table->program = format_program_get(table->cache, VARDATA_ANY(format_string_text),
+                                        VARSIZE_ANY_EXHDR(format_string_text));
+
+    table->rel = table_open(relid, AccessShareLock);
+
+    if (table->rel->rd_rel->relkind != RELKIND_RELATION && table->rel->rd_rel->relkind != RELKIND_MATVIEW)
+      ereport(ERROR, (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                      errmsg("\"%s\" is not a table or materialized view", RelationGetRelationName(table->rel))));
+
+    aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+    if (aclresult != ACLCHECK_OK)
+      aclcheck_error(aclresult, get_relkind_objtype(table->rel->rd_rel->relkind), RelationGetRelationName(table->rel));
+
+    /* Row-level security policies are applied by the executor, which the scan bypasses */
+    if (check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED)
+      ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                      errmsg("format_x_table() does not support relations with row-level security")));
+
+    table->record = format_record_get(table->cache, RelationGetForm(table->rel)->reltype, -1);
+    table->slot = table_slot_create(table->rel, NULL);
+    table->scan = table_beginscan(table->rel, GetActiveSnapshot(), 0, NULL);
+
+    if (rsinfo != NULL && IsA(rsinfo, ReturnSetInfo))
+      RegisterExprContextCallback(rsinfo->econtext, format_table_shutdown, PointerGetDatum(table));
+
+    funcctx->user_fctx = table;
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  table = (FormatTableData *) funcctx->user_fctx;
+
+  if (table->scan != NULL && table_scan_getnextslot(table->scan, ForwardScanDirection, table->slot)) {
+    FormatargInfoData arginfodata = {
+      .cache = table->cache,
+      .nargs = 2,
+      .slot = table->slot,
+      .record = table->record };
+    text *result = format_run(table->program, &arginfodata, format_call_begin(table->cache));
+
+    SRF_RETURN_NEXT(funcctx, PointerGetDatum(result));
+  }
+
+  /* The state is freed along with the multi-call context, so it must not be shut down again */
+  if (table->scan != NULL) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    if (rsinfo != NULL && IsA(rsinfo, ReturnSetInfo))
+      UnregisterExprContextCallback(rsinfo->econtext, format_table_shutdown, PointerGetDatum(table));
+    format_table_shutdown(PointerGetDatum(table));
+  }
+  SRF_RETURN_DONE(funcctx);
+}
+
+static void format_table_shutdown(Datum arg) {
+  FormatTableData *table = (FormatTableData *) DatumGetPointer(arg);
+
+  if (table->scan == NULL)
+    return;
+
+  table_endscan(table->scan);
+  table->scan = NULL;
+  ExecDropSingleTupleTableSlot(table->slot);
+
+  /* The lock is kept until the end of the transaction */
+  table_close(table->rel, NoLock);
+}
+
+/*
+ * Format a statement and run it, returning the number of rows it processed.
+ *
+ * Unlike EXECUTE format_x(...), %L values are not quoted into the statement
+ * but passed as parameters, so the text of the statement only depends on the
+ * %I and %s values. A value is passed as its own type, unless it is a string,
+ * null or truncated, in which case the type of its parameter is inferred from
+ * its context as the type of a quoted literal would be. The statement is
+ * prepared the first time its text is seen in the session with values of
+ * these types, and the plan is reused from then on.
+ */
+Datum format_x_exec(PG_FUNCTION_ARGS) {
+  text *format_string_text;
+  FormatProgramData *program;
+  FormatParamsData params = {
+    .mcxt = CurrentMemoryContext };
+  FormatargInfoData arginfodata = {
+    .fcinfo = fcinfo,
+    .params = &params };
+  MemoryContext oldcontext;
+  char *sql;
+  FormatPlanData *plan;
+  ParamListInfo paramLI;
+  int ret;
+  uint64 processed;
+
+  /* When format string is null, immediately return null */
+  if (PG_ARGISNULL(0))
+    PG_RETURN_NULL();
+
+  arginfodata.cache = format_cache_get(fcinfo->flinfo);
+  oldcontext = format_call_begin(arginfodata.cache);
+
+  make_argument_data(&arginfodata, fcinfo, 0);
+
+  format_string_text = PG_GETARG_TEXT_PP(0);
+  program = format_program_get(arginfodata.cache, VARDATA_ANY(format_string_text),
+                               VARSIZE_ANY_EXHDR(format_string_text));
+
+  sql = text_to_cstring(format_run(program, &arginfodata, oldcontext));
+
+  if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+    elog(ERROR, "SPI_connect failed: %s", SPI_result_code_string(ret));
+
+  plan = format_plan_get(sql, &params);
+
+  paramLI = makeParamList(params.nparams);
+  for (int i = 0; i < params.nparams; i++) {
+    ParamExternData *prm = &paramLI->params[i];
+
+    /* A value that is already of the parameter's type doesn't go through its input function */
+    if (!params.nulls[i] && params.values[i] == NULL)
+      prm->value = params.datums[i];
+    else
+      prm->value = InputFunctionCall(&plan->inputs[i], params.values[i], plan->typioparams[i], -1);
+    prm->isnull = params.nulls[i];
+    prm->pflags = PARAM_FLAG_CONST;
+    prm->ptype = plan->paramtypes[i];
+  }
+
+  ret = SPI_execute_plan_with_paramlist(plan->plan, paramLI, false, 0);
+  if (ret < 0)
+    elog(ERROR, "SPI_execute_plan_with_paramlist failed: %s", SPI_result_code_string(ret));
+  processed = SPI_processed;
+
+  SPI_finish();
+
+  PG_RETURN_INT64((int64) processed);
+}
+
+static void format_append_param(StringInfoData *output, FormatParamsData *params, Object *object, char *val, int vallen, Oid type) {
+  int n = params->nparams;
+
+  if (n >= params->maxparams) {
+    if (params->maxparams == 0) {
+      params->maxparams = 8;
+      params->values = MemoryContextAlloc(params->mcxt, params->maxparams * sizeof(char *));
+      params->datums = MemoryContextAlloc(params->mcxt, params->maxparams * sizeof(Datum));
+      params->nulls = MemoryContextAlloc(params->mcxt, params->maxparams * sizeof(bool));
+      params->types = MemoryContextAlloc(params->mcxt, params->maxparams * sizeof(Oid));
+    }
+    else {
+      params->maxparams *= 2;
+      params->values = repalloc(params->values, params->maxparams * sizeof(char *));
+      params->datums = repalloc(params->datums, params->maxparams * sizeof(Datum));
+      params->nulls = repalloc(params->nulls, params->maxparams * sizeof(bool));
+      params->types = repalloc(params->types, params->maxparams * sizeof(Oid));
+    }
+  }
+
+  params->types[n] = type;
+  params->nulls[n] = object->isNull;
+  params->values[n] = NULL;
+  params->datums[n] = (Datum) 0;
+
+  if (val != NULL) {
+    char *value = MemoryContextAlloc(params->mcxt, vallen + 1);
+
+    memcpy(value, val, vallen);
+    value[vallen] = '\0';
+    params->values[n] = value;
+  }
+  else if (!object->isNull) {
+    /* The value may be in the scratch context, or point into an argument that is */
+    MemoryContext oldcontext = MemoryContextSwitchTo(params->mcxt);
+    int16 typlen;
+    bool typbyval;
+
+    get_typlenbyval(type, &typlen, &typbyval);
+    params->datums[n] = datumCopy(object->item, typbyval, typlen);
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  params->nparams++;
+  appendStringInfo(output, "$%d", params->nparams);
+}
+
+static FormatPlanData *format_plan_get(char *sql, FormatParamsData *params) {
+  FormatPlanKeyData key = {
+    .sql = sql,
+    .nparams = params->nparams,
+    .types = params->types };
+  FormatPlanEntry *entry;
+  FormatPlanData *plan;
+  MemoryContext mcxt;
+  int nparams = params->nparams;
+
+  if (format_plans == NULL) {
+    HASHCTL ctl;
+
+    format_plan_context = AllocSetContextCreate(TopMemoryContext, "format_x plans", ALLOCSET_DEFAULT_SIZES);
+
+    ctl.keysize = sizeof(FormatPlanKeyData);
+    ctl.entrysize = sizeof(FormatPlanEntry);
+    ctl.hash = format_plan_hash;
+    ctl.match = format_plan_match;
+    ctl.hcxt = format_plan_context;
+    format_plans = hash_create("format_x plans", 64, &ctl, HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+  }
+
+  entry = hash_search(format_plans, &key, HASH_FIND, NULL);
+  if (entry != NULL)
+    return entry->plan;
+
+  /*
+   * The plan is built in a context of its own, under the SPI context so that
+   * it goes away with an error, and is only moved under format_plan_context
+   * once it is kept. It is the argument of format_plan_parser_setup() for as
+   * long as the plan is, so it can't be copied.
+   */
+  mcxt = AllocSetContextCreate(CurrentMemoryContext, "format_x plan", ALLOCSET_SMALL_SIZES);
+
+  plan = MemoryContextAllocZero(mcxt, sizeof(FormatPlanData));
+  plan->mcxt = mcxt;
+  plan->key.sql = MemoryContextStrdup(mcxt, sql);
+  plan->key.nparams = nparams;
+  plan->key.types = MemoryContextAlloc(mcxt, nparams * sizeof(Oid));
+  if (nparams > 0)
+    memcpy(plan->key.types, params->types, nparams * sizeof(Oid));
+
+  /*
+   * Parameters of a type other than InvalidOid are of that type, and the
+   * others are inferred from the statement as it is analyzed, as PREPARE does
+   * when it is given no types.
+   */
+  plan->paramtypes = MemoryContextAlloc(mcxt, nparams * sizeof(Oid));
+  if (nparams > 0)
+    memcpy(plan->paramtypes, params->types, nparams * sizeof(Oid));
+  plan->nparamtypes = nparams;
+
+  plan->plan = SPI_prepare_params(sql, format_plan_parser_setup, plan, 0);
+  if (plan->plan == NULL)
+    elog(ERROR, "SPI_prepare_params failed: %s", SPI_result_code_string(SPI_result));
+
+  /* The statement can only refer to the parameters made from %L values */
+  if (plan->nparamtypes > nparams)
+    ereport(ERROR, (errcode(ERRCODE_UNDEFINED_PARAMETER), errmsg("there is no parameter $%d", plan->nparamtypes)));
+
+  /*
+   * A parameter whose type can't be inferred is left unknown, and its value
+   * is passed as is, as an unknown literal would be. One that is not used by
+   * the statement is unknown too.
+   */
+  plan->inputs = MemoryContextAlloc(mcxt, nparams * sizeof(FmgrInfo));
+  plan->typioparams = MemoryContextAlloc(mcxt, nparams * sizeof(Oid));
+  for (int i = 0; i < nparams; i++) {
+    Oid typinput;
+
+    if (plan->paramtypes[i] == InvalidOid)
+      plan->paramtypes[i] = UNKNOWNOID;
+
+    getTypeInputInfo(plan->paramtypes[i], &typinput, &plan->typioparams[i]);
+    fmgr_info_cxt(typinput, &plan->inputs[i], mcxt);
+  }
+  plan->analyzed = true;
+
+  /* Once the cache is full, the statement is only prepared for this call, in the SPI context */
+  if (hash_get_num_entries(format_plans) >= FORMAT_MAX_PLANS)
+    return plan;
+
+  if (SPI_keepplan(plan->plan) != 0)
+    elog(ERROR, "SPI_keepplan failed: %s", SPI_result_code_string(SPI_result));
+  MemoryContextSetParent(mcxt, format_plan_context);
+
+  entry = hash_search(format_plans, &plan->key, HASH_ENTER, NULL);
+  entry->plan = plan;
+
+  return plan;
+}
+
+static void format_plan_parser_setup(ParseState *pstate, void *arg) {
+  FormatPlanData *plan = (FormatPlanData *) arg;
+
+  /* When the plan is invalidated, the statement is analyzed again with the types it was first given */
+  if (plan->analyzed)
+    setup_parse_fixed_parameters(pstate, plan->paramtypes, plan->nparamtypes);
+  else
+    setup_parse_variable_parameters(pstate, &plan->paramtypes, &plan->nparamtypes);
+}
+
+static uint32 format_plan_hash(const void *key, Size keysize) {
+  const FormatPlanKeyData *planKey = (const FormatPlanKeyData *) key;
+  uint32 hash = hash_bytes((const unsigned char *) planKey->sql, strlen(planKey->sql));
+
+  return hash_combine(hash, hash_bytes((const unsigned char *) planKey->types, planKey->nparams * sizeof(Oid)));
+}
+
+static int format_plan_match(const void *key1, const void *key2, Size keysize) {
+  const FormatPlanKeyData *planKey1 = (const FormatPlanKeyData *) key1;
+  const FormatPlanKeyData *planKey2 = (const FormatPlanKeyData *) key2;
+
+  if (planKey1->nparams != planKey2->nparams)
+    return 1;
+  if (memcmp(planKey1->types, planKey2->types, planKey1->nparams * sizeof(Oid)) != 0)
+    return 1;
+  return strcmp(planKey1->sql, planKey2->sql);
+}
+
+/*
+ * Aggregate transition function for format_x_agg(string, separator, formatarg).
+ *
+ * The state is a StringInfo allocated in the aggregate context, and every row
+ * is formatted straight into it, preceded by its separator. As in string_agg()
+ * the separator of the first row is dropped by the final function, which finds
+ * its length in the cursor field; this keeps the combine function a plain
+ * concatenation. Rows with a null format string are skipped.
+ */
+Datum format_x_agg_transfn(PG_FUNCTION_ARGS) {
+  MemoryContext aggcontext;
+  MemoryContext oldcontext;
+  StringInfo state;
+  text *format_string_text;
+  text *separator = NULL;
+  FormatProgramData *program;
+  FormatargInfoData arginfodata = {
+    .fcinfo = fcinfo };
+
+  if (!AggCheckCallContext(fcinfo, &aggcontext))
+    elog(ERROR, "format_x_agg_transfn called in non-aggregate context");
+
+  state = PG_ARGISNULL(0) ? NULL : (StringInfo) PG_GETARG_POINTER(0);
+
+  if (PG_ARGISNULL(1)) {
+    /* A null pointer must not be returned as a non-null internal state */
+    if (state == NULL)
+      PG_RETURN_NULL();
+    PG_RETURN_POINTER(state);
+  }
+
+  arginfodata.cache = format_cache_get(fcinfo->flinfo);
+  oldcontext = format_call_begin(arginfodata.cache);
+
+  if (!PG_ARGISNULL(2))
+    separator = PG_GETARG_TEXT_PP(2);
+
+  if (state == NULL) {
+    MemoryContextSwitchTo(aggcontext);
+    state = makeStringInfo();
+    MemoryContextSwitchTo(arginfodata.cache->scratch);
+
+    if (separator != NULL)
+      state->cursor = VARSIZE_ANY_EXHDR(separator);
+  }
+
+  if (separator != NULL)
+    appendBinaryStringInfo(state, VARDATA_ANY(separator), VARSIZE_ANY_EXHDR(separator));
+
+  /* The only parameter is formatarg, after the separator */
+  make_argument_data(&arginfodata, fcinfo, 2);
+
+  format_string_text = PG_GETARG_TEXT_PP(1);
+  program = format_program_get(arginfodata.cache, VARDATA_ANY(format_string_text),
+                               VARSIZE_ANY_EXHDR(format_string_text));
+
+  format_render(program, state, &arginfodata);
+
+  format_call_end(arginfodata.cache, oldcontext);
+
+  PG_RETURN_POINTER(state);
+}
+
+Datum format_x_agg_finalfn(PG_FUNCTION_ARGS) {
+  StringInfo state;
+
+  /* cannot be called directly because of internal-type argument */
+  Assert(AggCheckCallContext(fcinfo, NULL));
+
+  state = PG_ARGISNULL(0) ? NULL : (StringInfo) PG_GETARG_POINTER(0);
+
+  if (state == NULL)
+    PG_RETURN_NULL();
+
+  /* As per comment in format_x_agg_transfn, strip the first separator */
+  PG_RETURN_TEXT_P(cstring_to_text_with_len(state->data + state->cursor, state->len - state->cursor));
+}
+
+Datum format_x_agg_combinefn(PG_FUNCTION_ARGS) {
+  MemoryContext aggcontext;
+  StringInfo state1;
+  StringInfo state2;
+
+  if (!AggCheckCallContext(fcinfo, &aggcontext))
+    elog(ERROR, "format_x_agg_combinefn called in non-aggregate context");
+
+  state1 = PG_ARGISNULL(0) ? NULL : (StringInfo) PG_GETARG_POINTER(0);
+  state2 = PG_ARGISNULL(1) ? NULL : (StringInfo) PG_GETARG_POINTER(1);
+
+  if (state2 == NULL) {
+    if (state1 == NULL)
+      PG_RETURN_NULL();
+    PG_RETURN_POINTER(state1);
+  }
+
+  if (state1 == NULL) {
+    /* We must copy state2's data into the aggregate context */
+    MemoryContext oldcontext = MemoryContextSwitchTo(aggcontext);
+
+    state1 = makeStringInfo();
+    state1->cursor = state2->cursor;
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  /* state2 starts with its own first separator, which now goes between the two */
+  appendBinaryStringInfo(state1, state2->data, state2->len);
+
+  PG_RETURN_POINTER(state1);
+}
+
+Datum format_x_agg_serialfn(PG_FUNCTION_ARGS) {
+  StringInfo state;
+  StringInfoData buf;
+
+  /* cannot be called directly because of internal-type argument */
+  Assert(AggCheckCallContext(fcinfo, NULL));
+
+  state = (StringInfo) PG_GETARG_POINTER(0);
+
+  pq_begintypsend(&buf);
+  pq_sendint32(&buf, state->cursor);
+  pq_sendbytes(&buf, state->data, state->len);
+
+  PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+Datum format_x_agg_deserialfn(PG_FUNCTION_ARGS) {
+  bytea *sstate;
+  StringInfo state;
+  StringInfoData buf;
+  int datalen;
+
+  if (!AggCheckCallContext(fcinfo, NULL))
+    elog(ERROR, "format_x_agg_deserialfn called in non-aggregate context");
+
+  sstate = PG_GETARG_BYTEA_PP(0);
+
+  /* Copy the bytea into a StringInfo so that we can "receive" it using the standard recv-function infrastructure */
+  initStringInfo(&buf);
+  appendBinaryStringInfo(&buf, VARDATA_ANY(sstate), VARSIZE_ANY_EXHDR(sstate));
+
+  state = makeStringInfo();
+  state->cursor = pq_getmsgint(&buf, 4);
+  datalen = VARSIZE_ANY_EXHDR(sstate) - 4;
+  appendBinaryStringInfo(state, pq_getmsgbytes(&buf, datalen), datalen);
+  pq_getmsgend(&buf);
+
+  pfree(buf.data);
+
+  PG_RETURN_POINTER(state);
+}
+
+/*
+ * Report the counters of this backend as one row; the times are in
+ * milliseconds and stay 0 unless format_x.track_timing is on.
+ */
+Datum format_x_stats(PG_FUNCTION_ARGS) {
+  TupleDesc tupdesc;
+  Datum values[14];
+  bool nulls[14] = {0};
+  int i = 0;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+
+  values[i++] = Int64GetDatum(format_stats.calls);
+  values[i++] = Int64GetDatum(format_stats.template_hits);
+  values[i++] = Int64GetDatum(format_stats.template_misses);
+  values[i++] = Int64GetDatum(format_stats.record_lookups);
+  values[i++] = Int64GetDatum(format_stats.jsonb_lookups);
+  values[i++] = Int64GetDatum(format_stats.json_lookups);
+  values[i++] = Int64GetDatum(format_stats.hstore_lookups);
+  values[i++] = Int64GetDatum(format_stats.array_lookups);
+  values[i++] = Int64GetDatum(format_stats.lookup_misses);
+  values[i++] = Int64GetDatum(format_stats.bytes);
+  values[i++] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(format_stats.compile_time));
+  values[i++] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(format_stats.lookup_time));
+  values[i++] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(format_stats.output_time));
+  values[i++] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(format_stats.quote_time));
+  Assert(i == lengthof(values));
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+Datum format_x_stats_reset(PG_FUNCTION_ARGS) {
+  memset(&format_stats, 0, sizeof(format_stats));
+
+  PG_RETURN_VOID();
+}
+
+/* Used for values that can't be measured before they are converted */
+#define FORMAT_VALUE_ESTIMATE 16
+
+static Size format_estimate_length(FormatProgramData *program, FormatargInfoData *arginfodata) {
+  FunctionCallInfo fcinfo = arginfodata->fcinfo;
+  FormatCacheData *cache = arginfodata->cache;
+  Size length = program->literal_length;
+
+  for (int i = 0; i < program->ninstructions; i++) {
+    FormatInstructionData *instruction = &program->instructions[i];
+    int parameter = instruction->parameter;
+    Size vallen = FORMAT_VALUE_ESTIMATE;
 
-  int nargs;
+    if (instruction->type == '\0')
+      continue;
 
-  FunctionCallInfo fcinfo;
+    /* Only arguments that are output as they are can be measured; a parameter
+     * out of range is left for getarg() to complain about */
+    if (instruction->length == 0 && parameter < arginfodata->nargs && arginfodata->slot == NULL) {
+      if (!arginfodata->funcvariadic) {
+        int argno = arginfodata->argoffset + parameter;
 
-  Datum *elements;
-  bool *nulls;
-  Oid element_type;
+        if (cache->argtyplens[argno] == -1 && !PG_ARGISNULL(argno))
+          vallen = toast_raw_datum_size(PG_GETARG_DATUM(argno)) - VARHDRSZ;
+      }
+      else if (cache->elmlen == -1) {
+        bool isnull;
+        Datum element = format_variadic_get(arginfodata, parameter - 1, &isnull);
 
-  // HStore info
-  void *filehandle;
-  hstoreFindKeyF hstoreFindKey;
-  hstoreUpgradeF hstoreUpgrade;
-  Oid hstoreOid;
-} FormatargInfoData;
+        if (!isnull)
+          vallen = toast_raw_datum_size(element) - VARHDRSZ;
+      }
+    }
 
-/* This struct holds, eventually, the value to be written in place of a given format specifier in the output string. */
-/* It is created initially from the argument corresponding to that specifier. */
-typedef struct {
-  Datum item;
-  Oid typid;
-  bool isNull;
-} Object;
+    /* A value truncated to precision characters is only that long, however large it is */
+    if (instruction->precision >= 0)
+      vallen = Min(vallen, (Size) instruction->precision * pg_database_encoding_max_length());
 
-/* Read contiguous digits as a decimal number */
-static bool format_read_digits(char **cpp, char *endp, int *number);
+    length += Max(vallen, (Size) instruction->width);
+  }
 
-/* Read a format specifier (generally following the SUS printf specification) */
-static char *format_read_specifier(char *cp, char *endp, FormatSpecifierData *spec);
+  /*
+   * The last output is a better guess when values couldn't be measured, but
+   * only while it is close to the estimate: the buffer is returned as the
+   * result, so the slack left by one large row would be kept by every row
+   * after it.
+   */
+  if (cache->output_length <= 2 * length)
+    return Max(length, cache->output_length);
 
-/* Returns a formatted string when provided with named arguments */
-void format_engine(FormatSpecifierData *specifierdata, StringInfoData *output, FormatargInfoData *arginfodata);
+  return length;
+}
 
-/* Lookup an attribute by key (with length keylen) in object */
-/* The result and result type is returned by rewriting members of object */
-void format_lookup(Object *object, FormatargInfoData *arginfodata, char *key, int keylen);
-void record_lookup(Object *object, char *key, int keylen);
-void jsonb_lookup(Object *object, char *key, int keylen);
-void json_lookup(Object *object, char *key, int keylen);
-void hstore_lookup(Object *object, FormatargInfoData *arginfodata, char *key, int keylen);
+static void format_output_init(StringInfoData *output, Size estimate, MemoryContext mcxt) {
+  estimate = Min(estimate, MaxAllocSize - VARHDRSZ - 1);
 
-/* Parse the optional portions of the format specifier */
-char *option_format(StringInfoData *output, char *string, int length, int width, bool align_to_left);
+  output->maxlen = VARHDRSZ + estimate + 1;
+  output->data = MemoryContextAlloc(mcxt, output->maxlen);
+  output->len = VARHDRSZ;
+  output->data[output->len] = '\0';
+  output->cursor = 0;
+}
 
-/* Populate FormatargInfoData from FunctionCallInfo; copied from text_format() */
-void make_argument_data(FormatargInfoData *arginfodata, FunctionCallInfo fcinfo);
+static FormatCacheData *format_cache_get(FmgrInfo *flinfo) {
+  if (flinfo->fn_extra == NULL)
+    flinfo->fn_extra = format_cache_create(flinfo->fn_mcxt);
 
-/* Consume an FormatargInfoData and a position and return the datum at that position */
-Datum getarg(FormatargInfoData *arginfodata, int parameter, Oid *typid, bool *isNull);
+  return (FormatCacheData *) flinfo->fn_extra;
+}
 
-/* Check if typid belongs to hstore as hstore's oid is not constant */
-bool is_hstore(Oid typid, FormatargInfoData *arginfodata);
+static FormatCacheData *format_cache_create(MemoryContext mcxt) {
+  FormatCacheData *cache = MemoryContextAllocZero(mcxt, sizeof(FormatCacheData));
 
-/* findJsonbValueFromContainerLen() is static and must be copied here */
-/* findJsonbValueFromContainerLen() is a findJsonbValueFromContainer() wrapper that sets up JsonbValue key string. */
-static JsonbValue *findJsonbValueFromContainerLen(JsonbContainer *container,
-                                                           uint32 flags,
-                                                           char *key,
-                                                           uint32 keylen);
+  cache->mcxt = mcxt;
+  cache->scratch = AllocSetContextCreate(mcxt, "format_x scratch", ALLOCSET_SMALL_SIZES);
 
-/* For typid; GetAttributeByName() does not provide typid */
-Datum GetAttributeAndTypeByName(HeapTupleHeader tuple, const char *attname, Oid *atttypid, bool *isNull);
+  return cache;
+}
 
-#define ADVANCE_READ_POINTER(cp, endp) do { \
-  if (++(cp) >= (endp)) \
-    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), \
-		    errmsg("unterminated format_x() type specifier"), \
-		    errhint("For a single \"%%\" use \"%%%%\"."))); \
-} while (0)
+static MemoryContext format_call_begin(FormatCacheData *cache) {
+  /* Rows deformed during earlier calls are stale */
+  cache->generation++;
 
-Datum format_x(PG_FUNCTION_ARGS) {
-  text *format_string_text;
-  char *cp, *startp, *endp;
-  int last_parameter = 0;
-  FormatargInfoData arginfodata = {
-    .fcinfo = fcinfo };
-  FormatSpecifierData spec;
-  StringInfoData output;
+  /* Everything but the output is allocated in the scratch context, so that
+   * nothing is left behind in the caller's context. It is also reset before
+   * starting in case the previous call errored out. */
+  MemoryContextReset(cache->scratch);
+  return MemoryContextSwitchTo(cache->scratch);
+}
 
-  /* When format string is null, immediately return null */
-  if (PG_ARGISNULL(0))
-    PG_RETURN_NULL();
+static void format_call_end(FormatCacheData *cache, MemoryContext oldcontext) {
+  MemoryContextSwitchTo(oldcontext);
+  MemoryContextReset(cache->scratch);
+}
+
+static FormatProgramData *format_program_get(FormatCacheData *cache, char *startp, int length) {
+  instr_time start;
 
-  make_argument_data(&arginfodata, fcinfo);
+  /* The format string is usually a constant, so only compare it against the last one */
+  if (cache->program != NULL &&
+      cache->program->source_length == length &&
+      memcmp(FORMAT_PROGRAM_SOURCE(cache->program), startp, length) == 0) {
+    format_stats.template_hits++;
+    return cache->program;
+  }
 
-  arginfodata.filehandle = NULL;
-  arginfodata.hstoreFindKey = NULL;
-  arginfodata.hstoreUpgrade = NULL;
-  arginfodata.hstoreOid = InvalidOid;
+  format_stats.template_misses++;
 
-  format_string_text = PG_GETARG_TEXT_PP(0);
-  startp = VARDATA_ANY(format_string_text);
-  endp = startp + VARSIZE_ANY_EXHDR(format_string_text);
+  if (cache->program != NULL) {
+    pfree(cache->program);
+    cache->program = NULL;
+  }
+  FORMAT_TIMING_START(start);
+  cache->program = format_compile(startp, startp + length, cache->mcxt, NULL);
+  FORMAT_TIMING_END(start, compile_time);
 
-  initStringInfo(&output);
+  return cache->program;
+}
 
-  /* Scan format string looking for format specifiers */
-  for (cp = startp; cp < endp; cp++) {
-    /* If it's not the start of a format specifier just copy it to output */
-    if (*cp != '%') {
-      appendStringInfoCharMacro(&output, *cp);
-      continue;
-    }
-    ADVANCE_READ_POINTER(cp, endp);
+/*
+ * Compile a format string into a program.
+ *
+ * The format string is scanned once; literal text between format specifiers
+ * becomes a single literal run, and each format specifier is read with
+ * format_read_specifier() and has its parameter resolved (which only depends
+ * on the preceding format specifiers) and its keys split at '.'.
+ *
+ * The instructions and keys are collected in the current memory context and
+ * then packed into one chunk allocated in mcxt.
+ *
+ * If invalid is given, a malformed format string sets *invalid and returns
+ * NULL instead of raising an error.
+ */
+static FormatProgramData *format_compile(char *startp, char *endp, MemoryContext mcxt, bool *invalid) {
+  FormatInstructionData *instructions;
+  int ninstructions = 0;
+  int maxinstructions = 8;
+  FormatKeyData *keys;
+  int nkeys = 0;
+  int maxkeys = 8;
+  StringInfoData keystrings;
+  FormatSpecifierData spec;
+  FormatProgramData *program;
+  char *cp, *runp;
+  int last_parameter = 0;
+  int literal_length = 0;
+  Size size;
+
+  instructions = palloc(maxinstructions * sizeof(FormatInstructionData));
+  keys = palloc(maxkeys * sizeof(FormatKeyData));
+  initStringInfo(&keystrings);
+
+#define FORMAT_ADD_INSTRUCTION() do { \
+  if (ninstructions >= maxinstructions) { \
+    maxinstructions *= 2; \
+    instructions = repalloc(instructions, maxinstructions * sizeof(FormatInstructionData)); \
+  } \
+  memset(&instructions[ninstructions], 0, sizeof(FormatInstructionData)); \
+  ninstructions++; \
+} while (0)
 
-    /* Easy case: %% outputs a single % */
+#define FORMAT_ADD_LITERAL(from, to) do { \
+  if ((to) > (from)) { \
+    FORMAT_ADD_INSTRUCTION(); \
+    instructions[ninstructions - 1].offset = (from) - startp; \
+    instructions[ninstructions - 1].length = (to) - (from); \
+    literal_length += (to) - (from); \
+  } \
+} while (0)
+
+  /* Scan format string looking for format specifiers; everything before the next
+   * '%' is part of the literal run, so it is skipped with memchr() */
+  cp = runp = startp;
+  while (cp < endp && (cp = memchr(cp, '%', endp - cp)) != NULL) {
+    ADVANCE_READ_POINTER(cp, endp, invalid, NULL);
+
+    /* Easy case: %% outputs a single %, so keep the first one in the run and skip the second */
     if (*cp == '%') {
-      appendStringInfoCharMacro(&output, '%');
+      FORMAT_ADD_LITERAL(runp, cp);
+      cp = runp = cp + 1;
       continue;
     }
 
-    cp = format_read_specifier(cp, endp, &spec);
+    /* The run ends before the '%' */
+    FORMAT_ADD_LITERAL(runp, cp - 1);
+
+    cp = format_read_specifier(cp, endp, &spec, invalid);
+    if (cp == NULL)
+      return NULL;
+    cp = runp = cp + 1;
 
     if (spec.parameter == 0) {
       if (spec.key == NULL || spec.keylen == 0)
@@ -160,13 +1892,84 @@ Datum format_x(PG_FUNCTION_ARGS) {
       }
     } else last_parameter = spec.parameter;
 
-    format_engine(&spec, &output, &arginfodata);
+    FORMAT_ADD_INSTRUCTION();
+    instructions[ninstructions - 1].type = spec.type;
+    instructions[ninstructions - 1].flag = spec.flag;
+    instructions[ninstructions - 1].parameter = spec.parameter;
+    instructions[ninstructions - 1].width = spec.width;
+    instructions[ninstructions - 1].precision = spec.precision;
+    instructions[ninstructions - 1].offset = nkeys;
+
+    /* Split the key at '.' so that the lookups don't have to; empty keys are skipped */
+    for (int i = 0, start = 0; i <= spec.keylen; i++) {
+      if (i < spec.keylen && spec.key[i] != '.')
+        continue;
+
+      if (i > start) {
+        if (nkeys >= maxkeys) {
+          maxkeys *= 2;
+          keys = repalloc(keys, maxkeys * sizeof(FormatKeyData));
+        }
+        keys[nkeys].offset = keystrings.len;
+        keys[nkeys].length = i - start;
+        appendBinaryStringInfo(&keystrings, spec.key + start, i - start);
+        appendStringInfoChar(&keystrings, '\0');
+        nkeys++;
+      }
+      start = i + 1;
+    }
+
+    instructions[ninstructions - 1].length = nkeys - instructions[ninstructions - 1].offset;
   }
 
-  text *output_text;
-  output_text = cstring_to_text_with_len(output.data, output.len);
-  pfree(output.data);
-  PG_RETURN_TEXT_P(output_text);
+  FORMAT_ADD_LITERAL(runp, endp);
+
+#undef FORMAT_ADD_LITERAL
+#undef FORMAT_ADD_INSTRUCTION
+
+  /* Pack everything into a single chunk */
+  size = offsetof(FormatProgramData, instructions) +
+         ninstructions * sizeof(FormatInstructionData) +
+         nkeys * sizeof(FormatKeyData) +
+         (endp - startp) + keystrings.len;
+
+  program = MemoryContextAlloc(mcxt, size);
+  SET_VARSIZE(program, size);
+  program->version = FORMAT_PROGRAM_VERSION;
+  program->source_offset = offsetof(FormatProgramData, instructions) +
+                           ninstructions * sizeof(FormatInstructionData) +
+                           nkeys * sizeof(FormatKeyData);
+  program->ninstructions = ninstructions;
+  program->nkeys = nkeys;
+  program->source_length = endp - startp;
+  program->literal_length = literal_length;
+  memcpy(program->instructions, instructions, ninstructions * sizeof(FormatInstructionData));
+  memcpy(FORMAT_PROGRAM_SOURCE(program), startp, endp - startp);
+  memcpy(FORMAT_PROGRAM_SOURCE(program) + (endp - startp), keystrings.data, keystrings.len);
+
+  /* Key offsets are relative to the key strings until now */
+  for (int i = 0; i < nkeys; i++) {
+    FORMAT_PROGRAM_KEYS(program)[i].offset =
+      (FORMAT_PROGRAM_SOURCE(program) + (endp - startp) - (char *) program) + keys[i].offset;
+    FORMAT_PROGRAM_KEYS(program)[i].length = keys[i].length;
+  }
+
+  pfree(instructions);
+  pfree(keys);
+  pfree(keystrings.data);
+
+  return program;
+}
+
+static FormatProgramData *format_program_detoast(Datum datum) {
+  FormatProgramData *program = (FormatProgramData *) PG_DETOAST_DATUM(datum);
+
+  if (program->version != FORMAT_PROGRAM_VERSION)
+    program = format_compile(FORMAT_PROGRAM_SOURCE(program),
+                             FORMAT_PROGRAM_SOURCE(program) + program->source_length,
+                             CurrentMemoryContext, NULL);
+
+  return program;
 }
 
 /*
@@ -178,20 +1981,22 @@ Datum format_x(PG_FUNCTION_ARGS) {
  *
  * Note parsing invariant: at least one character is known to be available
  * before string end (endp) at entry, and this is still true at exit.
+ *
+ * If invalid is given, an error only sets *invalid, and false is returned.
  */
-static bool format_read_digits(char **cpp, char *endp, int *number) {
+static bool format_read_digits(char **cpp, char *endp, int *number, bool *invalid) {
   bool found = false;
   int old = 0;
 
   while (**cpp >= '0' && **cpp <= '9') {
-    int new = old * 10 + (**cpp - '0');
+    int new;
 
-    if (new / 10 != old) /* overflow? */
-      ereport(ERROR, (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
-                      errmsg("number is out of range")));
+    if (pg_mul_s32_overflow(old, 10, &new) || pg_add_s32_overflow(new, **cpp - '0', &new))
+      FORMAT_SYNTAX_ERROR(invalid, false, (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                                           errmsg("number is out of range")));
     old = new;
 
-    ADVANCE_READ_POINTER(*cpp, endp);
+    ADVANCE_READ_POINTER(*cpp, endp, invalid, false);
     found = true;
   }
 
@@ -214,9 +2019,11 @@ static bool format_read_digits(char **cpp, char *endp, int *number) {
  *
  * Note parsing invariant: at least one character is known to be available
  * before string end (endp) at entry, and this is still true at exit.
+ *
+ * If invalid is given, an error only sets *invalid, and NULL is returned.
  */
 static char *
-format_read_specifier(char *cp, char *endp, FormatSpecifierData *spec) {
+format_read_specifier(char *cp, char *endp, FormatSpecifierData *spec, bool *invalid) {
   int number;
 
   /* Set defaults for output specifier data */
@@ -226,10 +2033,10 @@ format_read_specifier(char *cp, char *endp, FormatSpecifierData *spec) {
     .keylen = 0,
     .flag = 0,
     .width = 0,
-    .precision = 0,
+    .precision = -1,
   };
 
-  if (format_read_digits(&cp, endp, &number)) {
+  if (format_read_digits(&cp, endp, &number, invalid)) {
     if (*cp != '$' && *cp != '(') {
       /* The number isn't argument position so assume it's width and skip
        * everything before precision */
@@ -242,9 +2049,11 @@ format_read_specifier(char *cp, char *endp, FormatSpecifierData *spec) {
 
     /* Explicit 0 for argument index is immediately refused */
     if (number == 0)
-      ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                      errmsg("format specifies argument 0, but arguments are numbered from 1")));
+      FORMAT_SYNTAX_ERROR(invalid, NULL, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                                          errmsg("format specifies argument 0, but arguments are numbered from 1")));
   }
+  else if (invalid != NULL && *invalid)
+    return NULL;
 
   /* There are only two possibilities at this point: either we just read a
    * number or we didn't. Since we use spec->parameter = 0 to indicate an
@@ -255,190 +2064,777 @@ format_read_specifier(char *cp, char *endp, FormatSpecifierData *spec) {
    * excludes the presence of a key. */
 
   if (*cp == '$' && spec->parameter > 0) {
-    ADVANCE_READ_POINTER(cp, endp);
+    ADVANCE_READ_POINTER(cp, endp, invalid, NULL);
   } else if (*cp == '(') {
     /* The character after this must be the start of the key */
-    ADVANCE_READ_POINTER(cp, endp);
+    ADVANCE_READ_POINTER(cp, endp, invalid, NULL);
     spec->key = cp;
 
     while (*cp != ')') {
       if (*cp == '(')
-        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                        errmsg("key cannot contain '('")));
-      ADVANCE_READ_POINTER(cp, endp);
+        FORMAT_SYNTAX_ERROR(invalid, NULL, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                                            errmsg("key cannot contain '('")));
+      ADVANCE_READ_POINTER(cp, endp, invalid, NULL);
     }
 
     /* At this point cp points immediately after the key end */
     spec->keylen = cp - spec->key;
-    ADVANCE_READ_POINTER(cp, endp);
+    ADVANCE_READ_POINTER(cp, endp, invalid, NULL);
   }
 
   /* Handle flags (only minus is supported now) */
   while (*cp == '-') {
     /* spec->flags |= FORMAT_FLAG_MINUS; */
     spec->flag = 1;
-    ADVANCE_READ_POINTER(cp, endp);
+    ADVANCE_READ_POINTER(cp, endp, invalid, NULL);
   }
 
   /* Check for direct width specification */
-  if (format_read_digits(&cp, endp, &number))
+  if (format_read_digits(&cp, endp, &number, invalid))
     spec->width = number;
+  else if (invalid != NULL && *invalid)
+    return NULL;
 
 format_read_precision:
   if (*cp == '.') {
-    ADVANCE_READ_POINTER(cp, endp);
+    ADVANCE_READ_POINTER(cp, endp, invalid, NULL);
 
-    if (!format_read_digits(&cp, endp, &spec->precision))
-      ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                      errmsg(". must be followed by precision")));
+    if (!format_read_digits(&cp, endp, &spec->precision, invalid))
+      FORMAT_SYNTAX_ERROR(invalid, NULL, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                                          errmsg(". must be followed by precision")));
   }
 
   /* Handle type (either 's', 'I', or 'L') */
   if (strchr("sIL", *cp) == NULL)
-    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                    errmsg("unrecognized format_x() type specifier \"%c\"",
-                            *cp),
-                    errhint("For a single \"%%\" use \"%%%%\".")));
+    FORMAT_SYNTAX_ERROR(invalid, NULL, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                                        errmsg("unrecognized format_x() type specifier \"%c\"",
+                                               *cp),
+                                        errhint("For a single \"%%\" use \"%%%%\".")));
   spec->type = *cp;
 
   return cp;
 }
 
-void format_engine(FormatSpecifierData *specifierdata, StringInfoData *output, FormatargInfoData *arginfodata) {
+void format_engine(FormatProgramData *program, FormatInstructionData *instruction, StringInfoData *output, FormatargInfoData *arginfodata) {
   Object object;
-  Oid prev_typid = InvalidOid;
-  FmgrInfo typoutputfinfo;
+  FormatKeyData *keys = FORMAT_PROGRAM_KEYS(program) + instruction->offset;
+  char type = instruction->type;
+  char buf[FORMAT_VALUE_BUFLEN];
   char *val;
   int vallen;
+  bool truncated = false;
+  Oid paramtype = InvalidOid;
+  instr_time start;
 
   object.isNull = false;
-  object.item = getarg(arginfodata, specifierdata->parameter, &object.typid, &object.isNull);
-
-  /* Handle lookup if there is a key */
-  if (specifierdata->key != NULL || specifierdata->keylen != 0) {
-    char *keycpy = palloc(specifierdata->keylen + 1);
-    keycpy[specifierdata->keylen] = '\0';
-    memcpy(keycpy, specifierdata->key, specifierdata->keylen);
-
-    size_t numchars = 0;
-    for (size_t i = 0; i <= specifierdata->keylen; i++) {
-      if (keycpy[i] == '.' || i == specifierdata->keylen) {
-        keycpy[i] = '\0';
-        format_lookup(&object, arginfodata, keycpy, numchars);
-        keycpy = keycpy + numchars + 1;
-        numchars = 0;
-      }
-      else {
-        numchars++;
-      }
+  object.container = NULL;
+  object.string = NULL;
+  object.json = NULL;
+  object.parameter = instruction->parameter;
+  object.item = getarg(arginfodata, instruction->parameter, &object.typid, &object.isNull);
+  if (arginfodata->slot != NULL && instruction->length == 0)
+    object.item = ExecFetchSlotHeapTupleDatum(arginfodata->slot);
+
+  /* Handle lookup for each key (already split at '.') */
+  if (instruction->length > 0) {
+    FORMAT_TIMING_START(start);
+    for (int i = 0; i < instruction->length; i++) {
+      format_lookup(&object, arginfodata, FORMAT_PROGRAM_STRING(program, keys[i].offset), keys[i].length);
+      object.parameter = 0;
+    }
+    FORMAT_TIMING_END(start, lookup_time);
+  }
+
+  if (type == 'L' && arginfodata->params != NULL) {
+    /* A parameter has no text to pad */
+    if (instruction->width > 0)
+      ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                      errmsg("format_x_exec() does not support a width for %%L")));
+
+    /* Strings, nulls and truncated values are typed from where they are used, as quoted literals */
+    if (!object.isNull && get_typtype(object.typid) != TYPTYPE_PSEUDO &&
+        object.typid != TEXTOID && object.typid != VARCHAROID && object.typid != BPCHAROID)
+      paramtype = object.typid;
+
+    /* A value that is its own Datum, and isn't rounded either, is passed as it is
+     * instead of being output as text only to be input again */
+    if (paramtype != InvalidOid && instruction->precision < 0 &&
+        object.string == NULL && object.container == NULL && object.json == NULL) {
+      format_append_param(output, arginfodata->params, &object, NULL, 0, paramtype);
+      return;
     }
   }
 
   if (object.isNull) {
-    if (specifierdata->type == 'I') {
+    if (type == 'I') {
       ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED), errmsg("null values cannot be formatted as an SQL identifier")));
     }
-    else if (specifierdata->type == 'L') {
+    else if (type == 'L' && arginfodata->params == NULL) {
       val = "NULL";
-      specifierdata->type = 's';
+      vallen = 4;
+      type = 's';
     }
-    else if (specifierdata->type == 's') {
+    else if (type == 's') {
       val = "";
+      vallen = 0;
     }
   }
   else {
-    /* For floats, trim if precision (precision is only formatting done before conversion to string) */
-    if (specifierdata->precision != 0 && (object.typid == FLOAT4OID || object.typid == FLOAT8OID)) {
-      object.item = DirectFunctionCall2(numeric_round, object.item, specifierdata->precision);
+    FORMAT_TIMING_START(start);
+    /* Fractional numbers are output with precision digits after the radix character */
+    if (instruction->precision >= 0 && object.container == NULL &&
+        (object.typid == FLOAT4OID || object.typid == FLOAT8OID || object.typid == NUMERICOID))
+      val = (object.string != NULL)
+        ? format_round_decimal(object.string, object.length, instruction->precision, buf, &vallen)
+        : format_fixed(&object, instruction->precision, buf, &vallen);
+    /* Other values are truncated to precision characters */
+    else if (instruction->precision >= 0) {
+      val = format_value_prefix(&object, instruction->precision, arginfodata->cache, buf, &vallen);
+      truncated = true;
     }
+    else
+      val = format_value(&object, arginfodata->cache, buf, &vallen);
+    FORMAT_TIMING_END(start, output_time);
+  }
+
+  /* Once val and vallen have been retrieved and converted, move on to other format specifiers */
+  /* val is not necessarily null-terminated, as it may point into the value itself */
+
+  if (type == 'L' && arginfodata->params != NULL)
+    format_append_param(output, arginfodata->params, &object, object.isNull ? NULL : val, object.isNull ? 0 : vallen,
+                        truncated ? InvalidOid : paramtype);
+  else if (type == 'I' || type == 'L') {
+    FORMAT_TIMING_START(start);
+    if (type == 'I')
+      format_append_identifier(output, val, vallen, instruction->width, instruction->flag);
+    else
+      format_append_literal(output, val, vallen, instruction->width, instruction->flag);
+    FORMAT_TIMING_END(start, quote_time);
+  }
+  else
+    option_format(output, val, vallen, instruction->width, instruction->flag);
+}
+
+/*
+ * Convert a (not null) object to a string.
+ *
+ * The result is not necessarily null-terminated and its length is returned in
+ * *length. Text-like values are returned in place and integers and booleans
+ * are written into buf; every other type goes through its type output function.
+ */
+static char *format_value(Object *object, FormatCacheData *cache, char *buf, int *length) {
+  char *val;
+
+  /* Strings found by a lookup */
+  if (object->string != NULL) {
+    *length = object->length;
+    return object->string;
+  }
 
-    /* Get the appropriate typOutput function */
-    if (object.typid != prev_typid) {
-      bool typIsVarlena;
-      Oid typoutputfunc;
+  /* Containers found by a chained jsonb lookup */
+  if (object->container != NULL) {
+    val = JsonbToCString(NULL, object->container, -1);
+    *length = strlen(val);
+    return val;
+  }
+
+  switch (object->typid) {
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID: {
+      text *t = DatumGetTextPP(object->item);
 
-      getTypeOutputInfo(object.typid, &typoutputfunc, &typIsVarlena);
-      fmgr_info(typoutputfunc, &typoutputfinfo);
-      prev_typid = object.typid;
+      *length = VARSIZE_ANY_EXHDR(t);
+      return VARDATA_ANY(t);
     }
+    case NAMEOID:
+      val = NameStr(*DatumGetName(object->item));
+      *length = strlen(val);
+      return val;
+    case INT2OID:
+      *length = pg_itoa(DatumGetInt16(object->item), buf);
+      return buf;
+    case INT4OID:
+      *length = pg_ltoa(DatumGetInt32(object->item), buf);
+      return buf;
+    case INT8OID:
+      *length = pg_lltoa(DatumGetInt64(object->item), buf);
+      return buf;
+    case BOOLOID:
+      buf[0] = DatumGetBool(object->item) ? 't' : 'f';
+      *length = 1;
+      return buf;
+    case NUMERICOID:
+      val = DatumGetCString(DirectFunctionCall1(numeric_out, object->item));
+      *length = strlen(val);
+      return val;
+    default:
+      val = OutputFunctionCall(format_typoutput_get(cache, object->typid), object->item);
+      *length = strlen(val);
+      return val;
+  }
+}
+
+/*
+ * A text that is stored compressed or out of line is only detoasted as far as
+ * it can hold precision characters, so that a preview of a large value does
+ * not fetch and decompress all of it.
+ */
+static char *format_value_prefix(Object *object, int precision, FormatCacheData *cache, char *buf, int *length) {
+  char *val;
+  int maxlen = pg_database_encoding_max_length();
+
+  if (object->string == NULL && object->container == NULL &&
+      (object->typid == TEXTOID || object->typid == VARCHAROID || object->typid == BPCHAROID) &&
+      VARATT_IS_EXTENDED(DatumGetPointer(object->item)) &&
+      !VARATT_IS_SHORT(DatumGetPointer(object->item)) &&
+      precision < PG_INT32_MAX / maxlen) {
+    text *t = DatumGetTextPSlice(object->item, 0, precision * maxlen);
 
-    val = OutputFunctionCall(&typoutputfinfo, object.item);
+    val = VARDATA_ANY(t);
+    *length = VARSIZE_ANY_EXHDR(t);
   }
+  else
+    val = format_value(object, cache, buf, length);
 
-  vallen = strlen(val);
+  /* A slice may end in the middle of a character, but only after precision whole characters */
+  *length = pg_mbcharcliplen(val, *length, precision);
+  return val;
+}
 
-  /* Once val and vallen have been retrieved and converted, move on to other format specifiers */
+static char *format_fixed(Object *object, int precision, char *buf, int *length) {
+  StaticAssertStmt(FORMAT_VALUE_BUFLEN >= DOUBLE_SHORTEST_DECIMAL_LEN, "buf is too small for a float8");
+
+  /* Floats start from their shortest exact decimal representation (as float4out()
+   * and float8out() output them by default), so the digits are those the value
+   * is usually seen with and no numeric is ever made. The digits are written
+   * to buf, which format_round_decimal() reads before writing the result. */
+  switch (object->typid) {
+    case FLOAT4OID:
+      return format_round_decimal(buf, float_to_shortest_decimal_bufn(DatumGetFloat4(object->item), buf),
+                                  precision, buf, length);
+    case FLOAT8OID:
+      return format_round_decimal(buf, double_to_shortest_decimal_bufn(DatumGetFloat8(object->item), buf),
+                                  precision, buf, length);
+    default: {
+      char *string = DatumGetCString(DirectFunctionCall1(numeric_out, object->item));
+
+      return format_round_decimal(string, strlen(string), precision, buf, length);
+    }
+  }
+}
+
+/*
+ * Round a decimal number such as "-12.345" or "1.5e+20" to precision digits
+ * after the radix character, rounding half away from zero like numeric_round().
+ *
+ * The result is put into buf if it fits in FORMAT_VALUE_BUFLEN bytes and is
+ * palloc'd otherwise. Anything that isn't a number ("NaN", "Infinity") is
+ * returned as is, so it must not be in a buffer that goes away, and so is a
+ * number with an exponent beyond FORMAT_MAX_EXPONENT, which has nothing to
+ * round and could not be written out in full anyway.
+ */
+static char *format_round_decimal(char *string, int strlength, int precision, char *buf, int *length) {
+  bool negative = false;
+  char *cp = string;
+  char *endp = string + strlength;
+  char digitbuf[FORMAT_VALUE_BUFLEN];
+  char *digits;
+  int ndigits = 0;
+  int64 point = -1; // number of digits before the radix character
+  int exponent = 0;
+  int64 nkeep;
+  bool zero = true;
+  char *result;
+  char *rp;
+  int64 size;
+
+  if (cp < endp && *cp == '-') {
+    negative = true;
+    cp++;
+  }
+
+  if (cp >= endp || *cp < '0' || *cp > '9') {
+    *length = strlength;
+    return string;
+  }
+
+  /* Collect the digits without the radix character; there is room for one
+   * more in front of them in case rounding carries */
+  size = strlength + 2;
+  digits = ((size <= FORMAT_VALUE_BUFLEN) ? digitbuf : (char *) palloc(size)) + 1;
+  for (; cp < endp && *cp != 'e' && *cp != 'E'; cp++) {
+    if (*cp == '.')
+      point = ndigits;
+    else
+      digits[ndigits++] = *cp;
+  }
+  if (point < 0)
+    point = ndigits;
+  if (cp < endp) {
+    bool negative_exponent = false;
+
+    if (++cp < endp && (*cp == '-' || *cp == '+'))
+      negative_exponent = (*cp++ == '-');
+    /* Stop accumulating past the limit: all the digits are then dropped, or all kept */
+    for (; cp < endp && exponent <= FORMAT_MAX_EXPONENT; cp++)
+      exponent = exponent * 10 + (*cp - '0');
+    if (exponent > FORMAT_MAX_EXPONENT && !negative_exponent) {
+      *length = strlength;
+      return string;
+    }
+    exponent = Min(exponent, FORMAT_MAX_EXPONENT);
+    if (negative_exponent)
+      exponent = -exponent;
+  }
+  point += exponent;
+
+  /* Round at the first digit that isn't kept; if none of the digits are kept
+   * then the value rounds to zero unless the first one is dropped at 5 or more */
+  nkeep = point + precision;
+  if (nkeep < ndigits) {
+    bool round_up = nkeep >= 0 && digits[nkeep] >= '5';
+
+    ndigits = (int) Max(nkeep, 0);
+    if (round_up) {
+      int i = ndigits - 1;
+
+      while (i >= 0 && digits[i] == '9')
+        digits[i--] = '0';
+      if (i >= 0)
+        digits[i]++;
+      else {
+        *--digits = '1';
+        ndigits++;
+        point++;
+      }
+    }
+  }
+
+  for (int i = 0; i < ndigits; i++) {
+    if (digits[i] != '0') {
+      zero = false;
+      break;
+    }
+  }
+
+  /* Sign, integer digits (at least one), radix character and fractional digits */
+  size = 1 + Max(point, 1) + 1 + precision + 1;
+  result = (size <= FORMAT_VALUE_BUFLEN) ? buf : palloc(size);
+  rp = result;
+
+  if (negative && !zero)
+    *rp++ = '-';
+
+  if (point <= 0)
+    *rp++ = '0';
+  for (int64 i = 0; i < point; i++)
+    *rp++ = (i < ndigits) ? digits[i] : '0';
+
+  if (precision > 0) {
+    *rp++ = '.';
+    for (int64 i = point; i < point + precision; i++)
+      *rp++ = (i >= 0 && i < ndigits) ? digits[i] : '0';
+  }
+  *rp = '\0';
+
+  *length = rp - result;
+  return result;
+}
+
+void format_lookup(Object *object, FormatargInfoData *arginfodata, char *key, int keylen) {
+  if (key == NULL || keylen == 0)
+    return;
+
+  if (object->isNull) {
+    ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                    errmsg("null arguments cannot be looked up in, so cannot be passed for named parameters")));
+  }
+
+  /* The first keys looked up in an argument of a dictionary-like type are resolved together */
+  if (object->parameter > 0 &&
+      (object->typid == JSONBOID || object->typid == JSONOID || is_hstore(object->typid))) {
+    format_group_lookup(object, arginfodata, key, keylen);
+  }
+
+  else if (type_is_rowtype(object->typid)) {
+    format_stats.record_lookups++;
+    record_lookup(object, arginfodata, key, keylen);
+  }
+
+  else if (object->typid == JSONBOID) {
+    format_stats.jsonb_lookups++;
+    jsonb_lookup(object, key, keylen);
+  }
+
+  else if (object->typid == JSONOID) {
+    format_stats.json_lookups++;
+    json_lookup(object, key, keylen);
+  }
+
+  else if (is_hstore(object->typid)) {
+    format_stats.hstore_lookups++;
+    hstore_lookup(object, key, keylen);
+  }
+
+  else if (type_is_array(object->typid)) {
+    format_stats.array_lookups++;
+    array_lookup(object, key, keylen);
+  }
+
+  else {
+    elog(ERROR, "Invalid argument type for key \"%s\"", key);
+  }
+}
+
+/*
+ * A program often looks up several keys in the same argument, as in
+ * '%1(name)s %1(code)s %1(population)s'. Rather than searching the argument
+ * once per key, all the keys the program looks up first in the argument are
+ * sorted into the order jsonb and hstore keep their keys in and resolved
+ * together, by a single walk over the entries when there are few enough of
+ * them and by one binary search per key otherwise.
+ */
+static void format_group_lookup(Object *object, FormatargInfoData *arginfodata, char *key, int keylen) {
+  FormatKeyGroupData *group;
+  int i;
+
+  if (object->typid == JSONBOID)
+    format_stats.jsonb_lookups++;
+  else if (object->typid == JSONOID)
+    format_stats.json_lookups++;
+  else
+    format_stats.hstore_lookups++;
+
+  group = format_key_group_get(arginfodata, object);
+  i = format_key_find(group->keys, group->keylens, group->nkeys, key, keylen);
+
+  if (i < 0 || !group->found[i]) {
+    format_key_missing(key, keylen);
+  }
+
+  *object = group->objects[i];
+}
 
-  /* Need to allocate memory for a new, null-terminated string */
-  /* The return value from hstore_lookup() and jsonb getter are not necessarily null-terminated */
-  char *string = palloc(vallen * sizeof(char) + 1);
-  memcpy(string, val, vallen);
-  string[vallen] = '\0';
-  int length = vallen;
+static FormatKeyGroupData *format_key_group_get(FormatargInfoData *arginfodata, Object *object) {
+  FormatProgramData *program = arginfodata->program;
+  FormatKeyGroupData *group;
+  ListCell *lc;
 
-  if (specifierdata->type == 'I') {
-    /* quote_identifier() sometimes returns a palloc'd string and sometimes returns the original string */
-    string = (char *) quote_identifier(string);
-    length = strlen(string);
+  foreach(lc, arginfodata->key_groups) {
+    group = (FormatKeyGroupData *) lfirst(lc);
+    if (group->parameter == object->parameter)
+      return group;
   }
-  else if (specifierdata->type == 'L') {
-    string = (char *) quote_literal_cstr(string);
-    length = strlen(string);
+
+  /* Collect the distinct first keys of the format specifiers for the parameter, in order */
+  group = palloc(sizeof(FormatKeyGroupData));
+  group->parameter = object->parameter;
+  group->nkeys = 0;
+  group->keys = palloc(program->ninstructions * sizeof(char *));
+  group->keylens = palloc(program->ninstructions * sizeof(int));
+
+  for (int i = 0; i < program->ninstructions; i++) {
+    FormatInstructionData *instruction = &program->instructions[i];
+    FormatKeyData *key;
+    char *keystring;
+    int j;
+    int cmp = 1;
+
+    if (instruction->type == '\0' || instruction->parameter != group->parameter || instruction->length == 0)
+      continue;
+
+    key = FORMAT_PROGRAM_KEYS(program) + instruction->offset;
+    keystring = FORMAT_PROGRAM_STRING(program, key->offset);
+
+    for (j = group->nkeys; j > 0; j--) {
+      cmp = format_key_compare(group->keys[j - 1], group->keylens[j - 1], keystring, key->length);
+      if (cmp <= 0)
+        break;
+    }
+    if (j > 0 && cmp == 0)
+      continue;
+
+    memmove(&group->keys[j + 1], &group->keys[j], (group->nkeys - j) * sizeof(char *));
+    memmove(&group->keylens[j + 1], &group->keylens[j], (group->nkeys - j) * sizeof(int));
+    group->keys[j] = keystring;
+    group->keylens[j] = key->length;
+    group->nkeys++;
+  }
+
+  group->objects = palloc(group->nkeys * sizeof(Object));
+  group->found = palloc0(group->nkeys * sizeof(bool));
+  for (int i = 0; i < group->nkeys; i++) {
+    group->objects[i] = *object;
+    group->objects[i].parameter = 0;
+  }
+
+  if (object->typid == JSONBOID)
+    jsonb_resolve_keys(group, &DatumGetJsonbP(object->item)->root);
+  else if (object->typid == JSONOID) {
+    text *t = DatumGetTextPP(object->item);
+
+    json_resolve_keys(group, VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t));
+  }
+  else
+    hstore_resolve_keys(group, hstore_cache.hstoreUpgrade(object->item));
+
+  arginfodata->key_groups = lappend(arginfodata->key_groups, group);
+  return group;
+}
+
+static int format_key_compare(char *key1, int keylen1, char *key2, int keylen2) {
+  if (keylen1 != keylen2)
+    return keylen1 < keylen2 ? -1 : 1;
+  return memcmp(key1, key2, keylen1);
+}
+
+static int format_key_find(char **keys, int *keylens, int nkeys, char *key, int keylen) {
+  int low = 0;
+  int high = nkeys;
+
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    int cmp = format_key_compare(keys[middle], keylens[middle], key, keylen);
+
+    if (cmp == 0)
+      return middle;
+    if (cmp < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return -1;
+}
+
+static bool format_key_group_walk(int nkeys, int count) {
+  /* A binary search looks at about log2(count) entries */
+  return count == 0 || (uint64) nkeys * (pg_leftmost_one_pos32(count) + 1) >= (uint64) count;
+}
+
+static void format_key_missing(char *key, int keylen) {
+  format_stats.lookup_misses++;
+  ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                  errmsg("key \"%.*s\" does not exist", keylen, key)));
+}
+
+static bool format_key_index(char *key, int keylen, int *index) {
+  int number = 0;
+
+  for (int i = 0; i < keylen; i++) {
+    if (key[i] < '0' || key[i] > '9' || number > (PG_INT32_MAX - (key[i] - '0')) / 10)
+      return false;
+    number = number * 10 + (key[i] - '0');
+  }
+
+  *index = number;
+  return keylen > 0;
+}
+
+static void jsonb_resolve_keys(FormatKeyGroupData *group, JsonbContainer *container) {
+  int count = JsonContainerSize(container);
+  char *base_addr = (char *) &container->children[count * 2];
+  uint32 offset = 0;
+  int k = 0;
+
+  /* The numeric keys of an array are its elements, found without a search */
+  if (JsonContainerIsArray(container) && !JsonContainerIsScalar(container)) {
+    for (int i = 0; i < group->nkeys; i++) {
+      JsonbValue *v;
+      int index;
+
+      if (!format_key_index(group->keys[i], group->keylens[i], &index))
+        continue;
+
+      v = getIthJsonbValueFromContainer(container, index);
+      if (v != NULL) {
+        jsonb_set_value(&group->objects[i], v);
+        group->found[i] = true;
+      }
+    }
+    return;
+  }
+
+  /* Other keys can only be found in objects */
+  if (!JsonContainerIsObject(container))
+    return;
+
+  if (!format_key_group_walk(group->nkeys, count)) {
+    for (int i = 0; i < group->nkeys; i++) {
+      JsonbValue *v = findJsonbValueFromContainerLen(container, JB_FOBJECT, group->keys[i], group->keylens[i]);
+
+      if (v != NULL) {
+        jsonb_set_value(&group->objects[i], v);
+        group->found[i] = true;
+      }
+    }
+    return;
+  }
+
+  /* The keys of an object come first, in the same order as the group's */
+  for (int i = 0; i < count && k < group->nkeys; i++) {
+    uint32 keyoffset = offset;
+    int cmp;
+
+    JBE_ADVANCE_OFFSET(offset, container->children[i]);
+    cmp = format_key_compare(base_addr + keyoffset, offset - keyoffset, group->keys[k], group->keylens[k]);
+
+    while (cmp > 0 && ++k < group->nkeys)
+      cmp = format_key_compare(base_addr + keyoffset, offset - keyoffset, group->keys[k], group->keylens[k]);
+
+    if (cmp == 0) {
+      JsonbValue v;
+
+      fillJsonbValue(container, count + i, base_addr, getJsonbOffset(container, count + i), &v);
+      jsonb_set_value(&group->objects[k], &v);
+      group->found[k] = true;
+      k++;
+    }
+  }
+}
+
+static void hstore_resolve_keys(FormatKeyGroupData *group, HStore *hs) {
+  int count = HS_COUNT(hs);
+  HEntry *entries = ARRPTR(hs);
+  char *strings = STRPTR(hs);
+  int k = 0;
+
+  if (!format_key_group_walk(group->nkeys, count)) {
+    for (int i = 0; i < group->nkeys; i++) {
+      int idx = hstore_cache.hstoreFindKey(hs, NULL, group->keys[i], group->keylens[i]);
+
+      if (idx >= 0) {
+        hstore_set_value(&group->objects[i], hs, idx);
+        group->found[i] = true;
+      }
+    }
+    return;
   }
 
-  string = option_format(output, string, length, specifierdata->width, specifierdata->flag);
-  if (specifierdata->type == 'L') {
-    pfree(string);
+  for (int i = 0; i < count && k < group->nkeys; i++) {
+    char *key = HSTORE_KEY(entries, strings, i);
+    int keylen = HSTORE_KEYLEN(entries, i);
+    int cmp = format_key_compare(key, keylen, group->keys[k], group->keylens[k]);
+
+    while (cmp > 0 && ++k < group->nkeys)
+      cmp = format_key_compare(key, keylen, group->keys[k], group->keylens[k]);
+
+    if (cmp == 0) {
+      hstore_set_value(&group->objects[k], hs, i);
+      group->found[k] = true;
+      k++;
+    }
   }
 }
 
-void format_lookup(Object *object, FormatargInfoData *arginfodata, char *key, int keylen) {
-  if (key == NULL || keylen == 0)
-    return;
+static void json_resolve_keys(FormatKeyGroupData *group, char *json, int jsonlen) {
+  char **values = palloc0(group->nkeys * sizeof(char *));
+  int *valuelens = palloc0(group->nkeys * sizeof(int));
+  char *cp = json;
+
+  while (cp < json + jsonlen && JSON_IS_WHITESPACE(*cp))
+    cp++;
+
+  if (cp < json + jsonlen && *cp == '[') {
+    for (int i = 0; i < group->nkeys; i++) {
+      int index;
 
-  if (object->isNull) {
-    ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
-                    errmsg("null arguments cannot be looked up in, so cannot be passed for named parameters")));
+      if (format_key_index(group->keys[i], group->keylens[i], &index))
+        json_scan_array(cp, json + jsonlen, index, &values[i], &valuelens[i]);
+    }
   }
+  else
+    json_scan_object(cp, json + jsonlen, group->nkeys, group->keys, group->keylens, values, valuelens);
 
-  if (type_is_rowtype(object->typid)) {
-    record_lookup(object, key, keylen);
+  for (int i = 0; i < group->nkeys; i++) {
+    if (values[i] != NULL) {
+      json_set_value(&group->objects[i], values[i], valuelens[i]);
+      group->found[i] = true;
+    }
   }
+}
 
-  else if (object->typid == JSONBOID) {
-    jsonb_lookup(object, key, keylen);
+void record_lookup(Object *object, FormatargInfoData *arginfodata, char *key, int keylen) {
+  FormatCacheData *cache = arginfodata->cache;
+  FormatRecordData *record = NULL;
+  FormatAttributeData *attribute;
+
+  /* The row scanned by format_x_table() is already in a slot */
+  if (arginfodata->slot != NULL && object->parameter > 0) {
+    attribute = format_attribute_get(cache, arginfodata->record, key, keylen);
+    object->item = slot_getattr(arginfodata->slot, attribute->attnum, &object->isNull);
+    object->typid = attribute->atttypid;
+    return;
   }
 
-  else if (is_hstore(object->typid, arginfodata)) {
-    hstore_lookup(object, arginfodata, key, keylen);
+  /* If this row was already looked up in during this call, it's still in the slot */
+  for (int i = 0; i < cache->nrecords; i++) {
+    if (cache->records[i]->datum == object->item && cache->records[i]->generation == cache->generation) {
+      record = cache->records[i];
+      break;
+    }
   }
 
-  else {
-    elog(ERROR, "Invalid argument type for key \"%s\"", key);
+  if (record == NULL) {
+    HeapTupleHeader tuple = DatumGetHeapTupleHeader(object->item);
+
+    record = format_record_get(cache, HeapTupleHeaderGetTypeId(tuple), HeapTupleHeaderGetTypMod(tuple));
+
+    /*
+     * The slot needs a HeapTuple not a bare HeapTupleHeader.  We set all
+     * the fields in the struct just in case user tries to inspect system
+     * columns.
+     */
+    record->tuple.t_len = HeapTupleHeaderGetDatumLength(tuple);
+    ItemPointerSetInvalid(&(record->tuple.t_self));
+    record->tuple.t_tableOid = InvalidOid;
+    record->tuple.t_data = tuple;
+
+    /* The row is deformed lazily, and only up to the attributes actually looked up */
+    ExecStoreHeapTuple(&record->tuple, record->slot, false);
+    record->datum = object->item;
+    record->generation = cache->generation;
   }
-}
 
-void record_lookup(Object *object, char *key, int keylen) {
-  HeapTupleHeader record = DatumGetHeapTupleHeader(object->item);
-  object->item = GetAttributeAndTypeByName(record, key, &object->typid, &object->isNull);
+  attribute = format_attribute_get(cache, record, key, keylen);
+  object->item = slot_getattr(record->slot, attribute->attnum, &object->isNull);
+  object->typid = attribute->atttypid;
 }
 
 void jsonb_lookup(Object *object, char *key, int keylen) {
-  Jsonb *jb = DatumGetJsonb(object->item);
+  JsonbContainer *container;
   JsonbValue *v;
-
-  v = findJsonbValueFromContainerLen(&jb->root, JB_FOBJECT, key, keylen);
+  int index;
+
+  /* A chained lookup continues in the container found by the previous one */
+  if (object->container != NULL)
+    container = object->container;
+  else
+    container = &DatumGetJsonbP(object->item)->root;
+  object->container = NULL;
+
+  /* A numeric key is an element of an array, found without a search */
+  if (JsonContainerIsArray(container) && !JsonContainerIsScalar(container) &&
+      format_key_index(key, keylen, &index))
+    v = getIthJsonbValueFromContainer(container, index);
+  else
+    v = findJsonbValueFromContainerLen(container, JB_FOBJECT, key, keylen);
   if (v == NULL) {
-    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                    errmsg("key \"%*s\" does not exist", keylen, key)));
+    format_key_missing(key, keylen);
   }
 
+  jsonb_set_value(object, v);
+}
+
+static void jsonb_set_value(Object *object, JsonbValue *v) {
   switch (v->type) {
     case jbvNull:
       object->isNull = true;
       break;
     case jbvString:
-      object->item = (Datum) cstring_to_text_with_len(v->val.string.val, v->val.string.len);
+      object->string = v->val.string.val;
+      object->length = v->val.string.len;
       object->typid = TEXTOID;
       break;
     case jbvNumeric:
@@ -449,9 +2845,12 @@ void jsonb_lookup(Object *object, char *key, int keylen) {
       object->item = (Datum) v->val.boolean;
       object->typid = BOOLOID;
       break;
+    case jbvBinary:
+      object->item = (Datum) 0;
+      object->container = v->val.binary.data;
+      break;
     case jbvArray:
     case jbvObject:
-    case jbvBinary:
       object->item = (Datum) JsonbValueToJsonb(v);
       break;
     default:
@@ -459,79 +2858,538 @@ void jsonb_lookup(Object *object, char *key, int keylen) {
   }
 }
 
-bool is_hstore(Oid typid, FormatargInfoData *arginfodata) {
-  /* If HStore has been previously detected, skip lookup for oid */
-  if (arginfodata->hstoreOid != InvalidOid) {
-    return arginfodata->hstoreOid == typid;
+/*
+ * Look up a key in a json object without parsing it into a jsonb.
+ *
+ * The json text is scanned only as far as needed to find the key, skipping
+ * the values of the other keys without looking into them (a json value is
+ * known to be valid). If a key appears more than once, its first value is
+ * used. The first keys looked up in an argument go through
+ * format_group_lookup() instead, so this only continues a chained lookup.
+ */
+void json_lookup(Object *object, char *key, int keylen) {
+  char *json;
+  int jsonlen;
+  char *value = NULL;
+  int valuelen = 0;
+
+  /* A chained lookup continues in the object found by the previous one */
+  if (object->json != NULL) {
+    json = object->json;
+    jsonlen = object->jsonlen;
   }
+  else {
+    text *t = DatumGetTextPP(object->item);
 
-  bool typIsVarlena;
-  Oid typoutputfunc;
-  FmgrInfo typoutputfinfo;
-  PGFunction hstore_out;
+    json = VARDATA_ANY(t);
+    jsonlen = VARSIZE_ANY_EXHDR(t);
+  }
 
-  getTypeOutputInfo(typid, &typoutputfunc, &typIsVarlena);
-  fmgr_info(typoutputfunc, &typoutputfinfo);
+  while (jsonlen > 0 && JSON_IS_WHITESPACE(*json)) {
+    json++;
+    jsonlen--;
+  }
 
-  hstore_out = load_external_function("hstore", "hstore_out", false, &arginfodata->filehandle);
+  if (jsonlen > 0 && *json == '[') {
+    int index;
 
-  if (typoutputfinfo.fn_addr == hstore_out) {
-    arginfodata->hstoreOid = typid;
-    return true;
+    if (format_key_index(key, keylen, &index))
+      json_scan_array(json, json + jsonlen, index, &value, &valuelen);
+  }
+  else
+    json_scan_object(json, json + jsonlen, 1, &key, &keylen, &value, &valuelen);
+
+  if (value == NULL) {
+    format_key_missing(key, keylen);
+  }
+
+  json_set_value(object, value, valuelen);
+}
+
+/* Skip a (valid) json string, returning the character after its closing quote */
+static char *json_skip_string(char *cp, char *endp) {
+  for (cp++; cp < endp && *cp != '"'; cp++) {
+    if (*cp == '\\')
+      cp++;
+  }
+  return cp + 1;
+}
+
+/* Skip a (valid) json value, returning the character after it */
+static char *json_skip_value(char *cp, char *endp) {
+  int depth = 0;
+
+  do {
+    if (*cp == '"')
+      cp = json_skip_string(cp, endp);
+    else if (*cp == '{' || *cp == '[') {
+      depth++;
+      cp++;
+    }
+    else if (*cp == '}' || *cp == ']') {
+      depth--;
+      cp++;
+    }
+    else if (depth == 0) {
+      /* A scalar ends at the next delimiter */
+      while (cp < endp && *cp != ',' && *cp != '}' && *cp != ']' && !JSON_IS_WHITESPACE(*cp))
+        cp++;
+    }
+    else
+      cp++;
+  } while (depth > 0 && cp < endp);
+
+  return cp;
+}
+
+/* Unescape a json string token (with its quotes) using the json lexer */
+static void json_unescape(char *token, int tokenlen, char **string, int *length) {
+  JsonLexContext *lex = makeJsonLexContextCstringLen(token, tokenlen, GetDatabaseEncoding(), true);
+  JsonParseErrorType result = json_lex(lex);
+
+  if (result != JSON_SUCCESS)
+    json_ereport_error(result, lex);
+
+  *string = lex->strval->data;
+  *length = lex->strval->len;
+}
+
+static void json_scan_object(char *cp, char *endp, int nkeys, char **keys, int *keylens, char **values, int *valuelens) {
+  while (cp < endp && JSON_IS_WHITESPACE(*cp))
+    cp++;
+
+  /* Keys can only be found in objects */
+  if (cp >= endp || *cp != '{')
+    return;
+  cp++;
+
+  /* The whole object is scanned, as the value of a key that appears more than
+   * once is its last, as for the -> operator and jsonb */
+  for (;;) {
+    char *name;
+    int namelen;
+    char *value;
+
+    while (cp < endp && JSON_IS_WHITESPACE(*cp))
+      cp++;
+    if (cp >= endp || *cp == '}')
+      break;
+
+    /* The member name is only unescaped if it has to be */
+    name = cp;
+    cp = json_skip_string(cp, endp);
+    namelen = cp - name;
+    if (memchr(name, '\\', namelen) != NULL)
+      json_unescape(name, namelen, &name, &namelen);
+    else {
+      name++;
+      namelen -= 2;
+    }
+
+    /* Skip the ':' and the whitespace around it */
+    while (cp < endp && (JSON_IS_WHITESPACE(*cp) || *cp == ':'))
+      cp++;
+
+    value = cp;
+    cp = json_skip_value(cp, endp);
+
+    {
+      int i = format_key_find(keys, keylens, nkeys, name, namelen);
+
+      if (i >= 0) {
+        values[i] = value;
+        valuelens[i] = cp - value;
+      }
+    }
+
+    while (cp < endp && (JSON_IS_WHITESPACE(*cp) || *cp == ','))
+      cp++;
+  }
+}
+
+static void json_scan_array(char *cp, char *endp, int index, char **value, int *valuelen) {
+  while (cp < endp && JSON_IS_WHITESPACE(*cp))
+    cp++;
+
+  if (cp >= endp || *cp != '[')
+    return;
+  cp++;
+
+  /* Skip the elements before index without looking into them */
+  for (int i = 0;; i++) {
+    char *element;
+
+    while (cp < endp && JSON_IS_WHITESPACE(*cp))
+      cp++;
+    if (cp >= endp || *cp == ']')
+      return;
+
+    element = cp;
+    cp = json_skip_value(cp, endp);
+
+    if (i == index) {
+      *value = element;
+      *valuelen = cp - element;
+      return;
+    }
+
+    while (cp < endp && (JSON_IS_WHITESPACE(*cp) || *cp == ','))
+      cp++;
+  }
+}
+
+static void json_set_value(Object *object, char *value, int valuelen) {
+  object->string = NULL;
+  object->json = NULL;
+
+  switch (*value) {
+    case '"':
+      /* Strings are used in place unless they have to be unescaped */
+      if (memchr(value, '\\', valuelen) != NULL)
+        json_unescape(value, valuelen, &object->string, &object->length);
+      else {
+        object->string = value + 1;
+        object->length = valuelen - 2;
+      }
+      object->typid = TEXTOID;
+      break;
+    case '{':
+    case '[':
+      /* Objects and arrays are output as they are, unless looked up in */
+      object->json = object->string = value;
+      object->jsonlen = object->length = valuelen;
+      object->typid = JSONOID;
+      break;
+    case 'n':
+      object->isNull = true;
+      break;
+    case 't':
+    case 'f':
+      object->item = BoolGetDatum(*value == 't');
+      object->typid = BOOLOID;
+      break;
+    default:
+      /* Numbers are output as they are, but can be rounded to a precision */
+      object->string = value;
+      object->length = valuelen;
+      object->typid = NUMERICOID;
+      break;
   }
-  
-  return false;
 }
 
-void hstore_lookup(Object *object, FormatargInfoData *arginfodata, char *key, int keylen) {
-  if (arginfodata->hstoreUpgrade == NULL) {
-    arginfodata->hstoreUpgrade = (hstoreUpgradeF) lookup_external_function(arginfodata->filehandle, "hstoreUpgrade");
+bool is_hstore(Oid typid) {
+  if (!hstore_cache.valid)
+    hstore_cache_resolve();
+
+  return OidIsValid(hstore_cache.hstoreOid) && hstore_cache.hstoreOid == typid;
+}
+
+static void hstore_cache_resolve(void) {
+  Relation rel;
+  ScanKeyData entry;
+  SysScanDesc scan;
+  HeapTuple tuple;
+  Oid nspid = InvalidOid;
+  Oid typid = InvalidOid;
+
+  if (!hstore_callback_registered) {
+    CacheRegisterSyscacheCallback(TYPEOID, hstore_cache_callback, (Datum) 0);
+    hstore_callback_registered = true;
   }
-  HStore *hs = arginfodata->hstoreUpgrade(object->item);
 
-  if (arginfodata->hstoreFindKey == NULL) {
-    int (*hstoreFindKey) (HStore*, int*, char*, int) = (int (*)(HStore*, int*, char*, int)) lookup_external_function(arginfodata->filehandle, "hstoreFindKey");
-    arginfodata->hstoreFindKey = hstoreFindKey;
+  hstore_cache = (HstoreCacheData) {
+    .valid = false,
+    .hstoreOid = InvalidOid,
+  };
+
+  /* Find the schema hstore is installed in, if it is installed at all */
+  rel = table_open(ExtensionRelationId, AccessShareLock);
+  ScanKeyInit(&entry, Anum_pg_extension_extname, BTEqualStrategyNumber, F_NAMEEQ,
+              CStringGetDatum("hstore"));
+  scan = systable_beginscan(rel, ExtensionNameIndexId, true, NULL, 1, &entry);
+
+  tuple = systable_getnext(scan);
+  if (HeapTupleIsValid(tuple))
+    nspid = ((Form_pg_extension) GETSTRUCT(tuple))->extnamespace;
+
+  systable_endscan(scan);
+  table_close(rel, AccessShareLock);
+
+  if (OidIsValid(nspid))
+    typid = GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid,
+                            CStringGetDatum("hstore"), ObjectIdGetDatum(nspid));
+
+  if (OidIsValid(typid)) {
+    bool typIsVarlena;
+    Oid typoutputfunc;
+    FmgrInfo typoutputfinfo;
+    PGFunction hstore_out;
+    void *filehandle;
+
+    /* Make sure the type found really is hstore by checking its output function */
+    getTypeOutputInfo(typid, &typoutputfunc, &typIsVarlena);
+    fmgr_info(typoutputfunc, &typoutputfinfo);
+
+    hstore_out = load_external_function("hstore", "hstore_out", true, &filehandle);
+
+    if (typoutputfinfo.fn_addr == hstore_out) {
+      hstore_cache.hstoreOid = typid;
+      hstore_cache.hstoreHash = GetSysCacheHashValue1(TYPEOID, ObjectIdGetDatum(typid));
+      hstore_cache.hstoreUpgrade = (hstoreUpgradeF) lookup_external_function(filehandle, "hstoreUpgrade");
+      hstore_cache.hstoreFindKey = (hstoreFindKeyF) lookup_external_function(filehandle, "hstoreFindKey");
+    }
   }
-  int idx = arginfodata->hstoreFindKey(hs, NULL, key, keylen);
+
+  hstore_cache.valid = true;
+}
+
+static void hstore_cache_callback(Datum arg, int cacheid, uint32 hashvalue) {
+  /* Once hstore is known only a change to the hstore type itself matters;
+   * until then any new type might be hstore */
+  if (!OidIsValid(hstore_cache.hstoreOid) || hashvalue == 0 || hashvalue == hstore_cache.hstoreHash)
+    hstore_cache.valid = false;
+}
+
+void hstore_lookup(Object *object, char *key, int keylen) {
+  HStore *hs = hstore_cache.hstoreUpgrade(object->item);
+
+  int idx = hstore_cache.hstoreFindKey(hs, NULL, key, keylen);
 
   /* If key is not found, generate error */
   if (idx < 0) {
-    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                    errmsg("key \"%*s\" does not exist", keylen, key)));
+    format_key_missing(key, keylen);
   }
 
+  hstore_set_value(object, hs, idx);
+}
+
+static void hstore_set_value(Object *object, HStore *hs, int idx) {
   if (HSTORE_VALISNULL(ARRPTR(hs), idx)) {
     object->isNull = true;
   }
 
-  object->item = (Datum) cstring_to_text_with_len(HSTORE_VAL(ARRPTR(hs), STRPTR(hs), idx), HSTORE_VALLEN(ARRPTR(hs), idx));
+  object->string = HSTORE_VAL(ARRPTR(hs), STRPTR(hs), idx);
+  object->length = HSTORE_VALLEN(ARRPTR(hs), idx);
   object->typid = TEXTOID;
 }
 
+/*
+ * Look up an element of a one-dimensional array by its subscript, as arr[n]
+ * would. The element is found without deconstructing the array: directly for
+ * an array of fixed-length elements without nulls, by skipping over the
+ * elements before it otherwise.
+ */
+void array_lookup(Object *object, char *key, int keylen) {
+  ArrayType *array = DatumGetArrayTypeP(object->item);
+  Oid elemtype = ARR_ELEMTYPE(array);
+  int16 elmlen;
+  bool elmbyval;
+  char elmalign;
+  int index;
+
+  if (ARR_NDIM(array) != 1 || !format_key_index(key, keylen, &index) ||
+      index < ARR_LBOUND(array)[0] || index - ARR_LBOUND(array)[0] >= ARR_DIMS(array)[0]) {
+    format_key_missing(key, keylen);
+  }
+
+  get_typlenbyvalalign(elemtype, &elmlen, &elmbyval, &elmalign);
+  object->item = array_get_element(PointerGetDatum(array), 1, &index, -1,
+                                   elmlen, elmbyval, elmalign, &object->isNull);
+  object->typid = elemtype;
+}
+
 char *option_format(StringInfoData *output, char *string, int length, int width, bool align_to_left) {
+  int charlen;
+
   if (width == 0) {
     appendBinaryStringInfo(output, string, length);
     return string;
   }
 
+  charlen = format_char_length(string, length);
+
   if (align_to_left) {
     // left justify
     appendBinaryStringInfo(output, string, length);
-    if (length < width) {
-      appendStringInfoSpaces(output, width - length);
+    if (charlen < width) {
+      appendStringInfoSpaces(output, width - charlen);
     }
   }
   else {
     // right justify
-    if (length < width) {
-      appendStringInfoSpaces(output, width - length);
+    if (charlen < width) {
+      appendStringInfoSpaces(output, width - charlen);
     }
     appendBinaryStringInfo(output, string, length);
   }
   return string;
 }
 
+/*
+ * Width is counted in characters, as format() counts it. Most values are
+ * ASCII, where that is the length in bytes, so they are checked a word at a
+ * time first and only other values are walked a character at a time.
+ */
+static int format_char_length(char *string, int length) {
+  if (pg_database_encoding_max_length() == 1 || format_is_ascii(string, length))
+    return length;
+
+  return pg_mbstrlen_with_len(string, length);
+}
+
+static bool format_is_ascii(char *string, int length) {
+  uint64 highbits = 0;
+  int i = 0;
+
+  /* The compiler can vectorize this loop since it doesn't exit early */
+  for (; i + (int) sizeof(uint64) <= length; i += sizeof(uint64)) {
+    uint64 chunk;
+
+    memcpy(&chunk, string + i, sizeof(uint64));
+    highbits |= chunk;
+  }
+
+  for (; i < length; i++)
+    highbits |= (unsigned char) string[i];
+
+  return (highbits & UINT64CONST(0x8080808080808080)) == 0;
+}
+
+/*
+ * Append string to output as an SQL identifier, quoting it only if necessary.
+ *
+ * This follows quote_identifier(), but the quoted identifier is written into
+ * output directly. Identifiers made of safe characters only need quotes if
+ * they are keywords, which quote_identifier() itself is asked about.
+ */
+static void format_append_identifier(StringInfoData *output, char *string, int length, int width, bool align_to_left) {
+  bool safe = length > 0 && ((string[0] >= 'a' && string[0] <= 'z') || string[0] == '_');
+  int nquotes = 0;
+  int quotedlen;
+  int quotedchars = 0; // the quoted length in characters, only counted if there is a width
+  char *dst;
+
+  for (int i = 0; i < length; i++) {
+    char ch = string[i];
+
+    if ((ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') || ch == '_')
+      continue;
+
+    safe = false;
+    if (ch == '"')
+      nquotes++;
+  }
+
+  if (safe) {
+    if (quote_all_identifiers)
+      safe = false;
+    else if (length < NAMEDATALEN) {
+      /* Keywords are all shorter than NAMEDATALEN */
+      char buf[NAMEDATALEN];
+      const char *quoted;
+
+      memcpy(buf, string, length);
+      buf[length] = '\0';
+
+      /* quote_identifier() returns the original string unless it needs quoting */
+      quoted = quote_identifier(buf);
+      if (quoted != buf) {
+        safe = false;
+        pfree((char *) quoted);
+      }
+    }
+  }
+
+  if (safe) {
+    option_format(output, string, length, width, align_to_left);
+    return;
+  }
+
+  quotedlen = length + nquotes + 2;
+  if (width > 0)
+    quotedchars = format_char_length(string, length) + nquotes + 2;
+
+  if (!align_to_left && quotedchars < width)
+    appendStringInfoSpaces(output, width - quotedchars);
+
+  enlargeStringInfo(output, quotedlen);
+  dst = output->data + output->len;
+
+  *dst++ = '"';
+  if (nquotes == 0) {
+    memcpy(dst, string, length);
+    dst += length;
+  }
+  else {
+    for (int i = 0; i < length; i++) {
+      if (string[i] == '"')
+        *dst++ = '"';
+      *dst++ = string[i];
+    }
+  }
+  *dst++ = '"';
+
+  output->len = dst - output->data;
+  output->data[output->len] = '\0';
+
+  if (align_to_left && quotedchars < width)
+    appendStringInfoSpaces(output, width - quotedchars);
+}
+
+/*
+ * Append string to output as an SQL literal.
+ *
+ * This follows quote_literal_cstr(), but the quoted literal is written into
+ * output directly: quotes and backslashes are doubled, and the E'' syntax is
+ * used if there are any backslashes.
+ */
+static void format_append_literal(StringInfoData *output, char *string, int length, int width, bool align_to_left) {
+  int nquotes = 0;
+  int nbackslashes = 0;
+  int quotedlen;
+  int quotedchars = 0; // the quoted length in characters, only counted if there is a width
+  char *dst;
+
+  for (int i = 0; i < length; i++) {
+    if (string[i] == '\'')
+      nquotes++;
+    else if (string[i] == '\\')
+      nbackslashes++;
+  }
+
+  quotedlen = length + nquotes + nbackslashes + 2 + (nbackslashes > 0 ? 1 : 0);
+  if (width > 0)
+    quotedchars = quotedlen - length + format_char_length(string, length);
+
+  if (!align_to_left && quotedchars < width)
+    appendStringInfoSpaces(output, width - quotedchars);
+
+  enlargeStringInfo(output, quotedlen);
+  dst = output->data + output->len;
+
+  if (nbackslashes > 0)
+    *dst++ = ESCAPE_STRING_SYNTAX;
+  *dst++ = '\'';
+  if (nquotes == 0 && nbackslashes == 0) {
+    memcpy(dst, string, length);
+    dst += length;
+  }
+  else {
+    for (int i = 0; i < length; i++) {
+      if (SQL_STR_DOUBLE(string[i], true))
+        *dst++ = string[i];
+      *dst++ = string[i];
+    }
+  }
+  *dst++ = '\'';
+
+  output->len = dst - output->data;
+  output->data[output->len] = '\0';
+
+  if (align_to_left && quotedchars < width)
+    appendStringInfoSpaces(output, width - quotedchars);
+}
+
 Datum getarg(FormatargInfoData *arginfodata, int parameter, Oid *typid, bool *isNull) {
   FunctionCallInfo fcinfo = arginfodata->fcinfo;
   Datum arg;
@@ -543,14 +3401,19 @@ Datum getarg(FormatargInfoData *arginfodata, int parameter, Oid *typid, bool *is
   }
 
   /* Get the value and type of the selected argument  */
-  if (!arginfodata->funcvariadic) {
-    arg = PG_GETARG_DATUM(parameter);
-    *isNull = PG_ARGISNULL(parameter);
-    *typid = get_fn_expr_argtype(arginfodata->fcinfo->flinfo, parameter);
+  if (arginfodata->slot != NULL) {
+    /* The scanned row is only made into a datum by format_engine() if it is output as a whole */
+    arg = (Datum) 0;
+    *isNull = false;
+    *typid = arginfodata->record->tupType;
+  }
+  else if (!arginfodata->funcvariadic) {
+    arg = PG_GETARG_DATUM(arginfodata->argoffset + parameter);
+    *isNull = PG_ARGISNULL(arginfodata->argoffset + parameter);
+    *typid = arginfodata->cache->argtypes[arginfodata->argoffset + parameter];
   }
   else {
-    arg = arginfodata->elements[parameter - 1];
-    *isNull = arginfodata->nulls[parameter - 1];
+    arg = format_variadic_get(arginfodata, parameter - 1, isNull);
     *typid = arginfodata->element_type;
   }
 
@@ -561,6 +3424,81 @@ Datum getarg(FormatargInfoData *arginfodata, int parameter, Oid *typid, bool *is
   return arg;
 }
 
+static FmgrInfo *format_typoutput_get(FormatCacheData *cache, Oid typid) {
+  FormatTypeOutputData *typoutput;
+  bool typIsVarlena;
+  Oid typoutputfunc;
+
+  /* There are only a handful of types per call site so a linear search is enough */
+  for (int i = 0; i < cache->ntypoutputs; i++) {
+    if (cache->typoutputs[i].typid == typid)
+      return &cache->typoutputs[i].typoutputfinfo;
+  }
+
+  if (cache->ntypoutputs >= cache->maxtypoutputs) {
+    if (cache->maxtypoutputs == 0) {
+      cache->maxtypoutputs = 4;
+      cache->typoutputs = MemoryContextAlloc(cache->mcxt, cache->maxtypoutputs * sizeof(FormatTypeOutputData));
+    }
+    else {
+      cache->maxtypoutputs *= 2;
+      cache->typoutputs = repalloc(cache->typoutputs, cache->maxtypoutputs * sizeof(FormatTypeOutputData));
+    }
+  }
+
+  typoutput = &cache->typoutputs[cache->ntypoutputs];
+  getTypeOutputInfo(typid, &typoutputfunc, &typIsVarlena);
+  fmgr_info_cxt(typoutputfunc, &typoutput->typoutputfinfo, cache->mcxt);
+  typoutput->typid = typid;
+  cache->ntypoutputs++;
+
+  return &typoutput->typoutputfinfo;
+}
+
+static void
+fillJsonbValue(JsonbContainer *container, int index,
+			   char *base_addr, uint32 offset,
+			   JsonbValue *result)
+{
+	JEntry		entry = container->children[index];
+
+	if (JBE_ISNULL(entry))
+	{
+		result->type = jbvNull;
+	}
+	else if (JBE_ISSTRING(entry))
+	{
+		result->type = jbvString;
+		result->val.string.val = base_addr + offset;
+		result->val.string.len = getJsonbLength(container, index);
+		Assert(result->val.string.len >= 0);
+	}
+	else if (JBE_ISNUMERIC(entry))
+	{
+		result->type = jbvNumeric;
+		result->val.numeric = (Numeric) (base_addr + INTALIGN(offset));
+	}
+	else if (JBE_ISBOOL_TRUE(entry))
+	{
+		result->type = jbvBool;
+		result->val.boolean = true;
+	}
+	else if (JBE_ISBOOL_FALSE(entry))
+	{
+		result->type = jbvBool;
+		result->val.boolean = false;
+	}
+	else
+	{
+		Assert(JBE_ISCONTAINER(entry));
+		result->type = jbvBinary;
+		/* Remove alignment padding from data pointer and length */
+		result->val.binary.data = (JsonbContainer *) (base_addr + INTALIGN(offset));
+		result->val.binary.len = getJsonbLength(container, index) -
+			(INTALIGN(offset) - offset);
+	}
+}
+
 static JsonbValue *
 findJsonbValueFromContainerLen(JsonbContainer *container, uint32 flags,
                                                            char *key, uint32 keylen)
@@ -574,89 +3512,123 @@ findJsonbValueFromContainerLen(JsonbContainer *container, uint32 flags,
         return findJsonbValueFromContainer(container, flags, &k);
 }
 
-Datum
-GetAttributeAndTypeByName(HeapTupleHeader tuple, const char *attname, Oid *atttypid, bool *isNull)
-{
-        AttrNumber      attrno;
-        Datum           result;
-        Oid                     tupType;
-        int32           tupTypmod;
-        TupleDesc       tupDesc;
-        HeapTupleData tmptup;
-        int                     i;
-
-        if (attname == NULL)
-                elog(ERROR, "invalid attribute name");
-
-        if (isNull == NULL)
-                elog(ERROR, "a NULL isNull pointer was passed");
-
-        if (tuple == NULL)
-        {
-                /* Kinda bogus but compatible with old behavior... */
-                *isNull = true;
-                return (Datum) 0;
-        }
+static FormatRecordData *format_record_get(FormatCacheData *cache, Oid tupType, int32 tupTypmod) {
+  FormatRecordData *record;
+  MemoryContext oldcontext;
 
-        tupType = HeapTupleHeaderGetTypeId(tuple);
-        tupTypmod = HeapTupleHeaderGetTypMod(tuple);
-        tupDesc = lookup_rowtype_tupdesc(tupType, tupTypmod);
-
-        attrno = InvalidAttrNumber;
-        for (i = 0; i < tupDesc->natts; i++)
-        {
-                if (namestrcmp(&(tupDesc->attrs[i]->attname), attname) == 0)
-                {
-                        attrno = tupDesc->attrs[i]->attnum;
-                        *atttypid = tupDesc->attrs[i]->atttypid;
-                        break;
-                }
-        }
+  for (int i = 0; i < cache->nrecords; i++) {
+    if (cache->records[i]->tupType == tupType && cache->records[i]->tupTypmod == tupTypmod)
+      return cache->records[i];
+  }
+
+  if (cache->nrecords >= cache->maxrecords) {
+    if (cache->maxrecords == 0) {
+      cache->maxrecords = 4;
+      cache->records = MemoryContextAlloc(cache->mcxt, cache->maxrecords * sizeof(FormatRecordData *));
+    }
+    else {
+      cache->maxrecords *= 2;
+      cache->records = repalloc(cache->records, cache->maxrecords * sizeof(FormatRecordData *));
+    }
+  }
+
+  oldcontext = MemoryContextSwitchTo(cache->mcxt);
+
+  record = palloc0(sizeof(FormatRecordData));
+  record->tupType = tupType;
+  record->tupTypmod = tupTypmod;
+  record->tupdesc = lookup_rowtype_tupdesc_copy(tupType, tupTypmod);
+  record->slot = MakeSingleTupleTableSlot(record->tupdesc, &TTSOpsHeapTuple);
+
+  MemoryContextSwitchTo(oldcontext);
+
+  cache->records[cache->nrecords++] = record;
+
+  return record;
+}
+
+static FormatAttributeData *format_attribute_get(FormatCacheData *cache, FormatRecordData *record, char *key, int keylen) {
+  FormatAttributeData *attribute;
+  AttrNumber attnum = InvalidAttrNumber;
+  Oid atttypid = InvalidOid;
+
+  for (int i = 0; i < record->nattributes; i++) {
+    if (record->attributes[i].keylen == keylen && memcmp(record->attributes[i].key, key, keylen) == 0)
+      return &record->attributes[i];
+  }
 
-        if (attrno == InvalidAttrNumber)
-                elog(ERROR, "attribute \"%s\" does not exist", attname);
+  for (int i = 0; i < record->tupdesc->natts; i++) {
+    Form_pg_attribute attr = TupleDescAttr(record->tupdesc, i);
+
+    if (attr->attisdropped)
+      continue;
+
+    if (namestrcmp(&attr->attname, key) == 0) {
+      attnum = attr->attnum;
+      atttypid = attr->atttypid;
+      break;
+    }
+  }
 
-        /*
-         * heap_getattr needs a HeapTuple not a bare HeapTupleHeader.  We set all
-         * the fields in the struct just in case user tries to inspect system
-         * columns.
-         */
-        tmptup.t_len = HeapTupleHeaderGetDatumLength(tuple);
-        ItemPointerSetInvalid(&(tmptup.t_self));
-        tmptup.t_tableOid = InvalidOid;
-        tmptup.t_data = tuple;
+  if (attnum == InvalidAttrNumber) {
+    format_stats.lookup_misses++;
+    elog(ERROR, "attribute \"%s\" does not exist", key);
+  }
 
-        result = heap_getattr(&tmptup,
-                                                  attrno,
-                                                  tupDesc,
-                                                  isNull);
+  if (record->nattributes >= record->maxattributes) {
+    if (record->maxattributes == 0) {
+      record->maxattributes = 4;
+      record->attributes = MemoryContextAlloc(cache->mcxt, record->maxattributes * sizeof(FormatAttributeData));
+    }
+    else {
+      record->maxattributes *= 2;
+      record->attributes = repalloc(record->attributes, record->maxattributes * sizeof(FormatAttributeData));
+    }
+  }
 
-        ReleaseTupleDesc(tupDesc);
+  /* The key is copied as the program it belongs to may be replaced */
+  attribute = &record->attributes[record->nattributes++];
+  attribute->key = MemoryContextStrdup(cache->mcxt, key);
+  attribute->keylen = keylen;
+  attribute->attnum = attnum;
+  attribute->atttypid = atttypid;
 
-        return result;
+  return attribute;
 }
 
-void make_argument_data(FormatargInfoData *arginfodata, FunctionCallInfo fcinfo) {
+void make_argument_data(FormatargInfoData *arginfodata, FunctionCallInfo fcinfo, int argoffset) {
+	FormatCacheData *cache = arginfodata->cache;
 	bool		funcvariadic;
 	int			nargs;
-	Datum	   *elements = NULL;
-	bool	   *nulls = NULL;
+	ArrayType  *arr = NULL;
 	Oid			element_type = InvalidOid;
 
+	/* The argument types only depend on the call site, so resolve them once */
+	if (!cache->argtypes_valid)
+	{
+		cache->funcvariadic = get_fn_expr_variadic(fcinfo->flinfo);
+		cache->nargtypes = PG_NARGS();
+		cache->argtypes = MemoryContextAlloc(cache->mcxt, cache->nargtypes * sizeof(Oid));
+		cache->argtyplens = MemoryContextAlloc(cache->mcxt, cache->nargtypes * sizeof(int16));
+		for (int i = 0; i < cache->nargtypes; i++)
+		{
+			cache->argtypes[i] = get_fn_expr_argtype(fcinfo->flinfo, i);
+			cache->argtyplens[i] = OidIsValid(cache->argtypes[i]) ? get_typlen(cache->argtypes[i]) : 0;
+		}
+		cache->element_type = InvalidOid;
+		cache->argtypes_valid = true;
+	}
+
 	/* If argument is marked VARIADIC, expand array into elements */
-	if (get_fn_expr_variadic(fcinfo->flinfo))
+	if (cache->funcvariadic)
 	{
-		ArrayType  *arr;
-		int16		elmlen;
-		bool		elmbyval;
-		char		elmalign;
 		int			nitems;
 
 		/* Should have just the one argument */
-		Assert(PG_NARGS() == 2);
+		Assert(PG_NARGS() == argoffset + 2);
 
 		/* If argument is NULL, we treat it as zero-length array */
-		if (PG_ARGISNULL(1))
+		if (PG_ARGISNULL(argoffset + 1))
 			nitems = 0;
 		else
 		{
@@ -667,19 +3639,15 @@ void make_argument_data(FormatargInfoData *arginfodata, FunctionCallInfo fcinfo)
 			 * an array.  So it should be okay to just Assert that it's an
 			 * array rather than doing a full-fledged error check.
 			 */
-			Assert(OidIsValid(get_base_element_type(get_fn_expr_argtype(fcinfo->flinfo, 1))));
+			Assert(OidIsValid(get_base_element_type(cache->argtypes[argoffset + 1])));
 
 			/* OK, safe to fetch the array value */
-			arr = PG_GETARG_ARRAYTYPE_P(1);
+			arr = PG_GETARG_ARRAYTYPE_P(argoffset + 1);
 
-			/* Get info about array element type */
+			/* The elements are only fetched as format specifiers refer to them */
 			element_type = ARR_ELEMTYPE(arr);
-			get_typlenbyvalalign(element_type,
-								 &elmlen, &elmbyval, &elmalign);
-
-			/* Extract all array elements */
-			deconstruct_array(arr, element_type, elmlen, elmbyval, elmalign,
-							  &elements, &nulls, &nitems);
+			format_element_storage(cache, element_type);
+			nitems = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
 		}
 
 		nargs = nitems + 1;
@@ -688,13 +3656,68 @@ void make_argument_data(FormatargInfoData *arginfodata, FunctionCallInfo fcinfo)
 	else
 	{
 		/* Non-variadic case, we'll process the arguments individually */
-		nargs = PG_NARGS();
+		nargs = PG_NARGS() - argoffset;
 		funcvariadic = false;
 	}
 
+        arginfodata->argoffset = argoffset;
         arginfodata->funcvariadic = funcvariadic;
         arginfodata->nargs = nargs;
-        arginfodata->elements = elements;
-        arginfodata->nulls = nulls;
+        arginfodata->array = arr;
+        arginfodata->iter_index = -1;
         arginfodata->element_type = element_type;
 }
+
+static void format_array_deconstruct(FormatCacheData *cache, ArrayType *arr, Datum **elements, bool **nulls, int *nitems) {
+  Oid element_type = ARR_ELEMTYPE(arr);
+
+  format_element_storage(cache, element_type);
+  deconstruct_array(arr, element_type, cache->elmlen, cache->elmbyval, cache->elmalign,
+                    elements, nulls, nitems);
+}
+
+static void format_element_storage(FormatCacheData *cache, Oid element_type) {
+  if (element_type != cache->element_type) {
+    get_typlenbyvalalign(element_type, &cache->elmlen, &cache->elmbyval, &cache->elmalign);
+    cache->element_type = element_type;
+  }
+}
+
+/*
+ * Fixed-width elements of an array without nulls are found at a fixed
+ * stride. Other elements can only be found by walking the array from its
+ * start, so the walk is kept between calls: the parameters of a format
+ * string are usually referred to in order, and are then all found in a
+ * single walk however many elements there are after the last one used.
+ */
+static Datum format_variadic_get(FormatargInfoData *arginfodata, int index, bool *isNull) {
+  FormatCacheData *cache = arginfodata->cache;
+  ArrayType *arr = arginfodata->array;
+
+  if (arr == NULL) {
+    *isNull = arginfodata->nulls[index];
+    return arginfodata->elements[index];
+  }
+
+  if (cache->elmlen > 0 && !ARR_HASNULL(arr)) {
+    *isNull = false;
+    return fetch_att(ARR_DATA_PTR(arr) + (Size) index * att_align_nominal(cache->elmlen, cache->elmalign),
+                     cache->elmbyval, cache->elmlen);
+  }
+
+  if (index != arginfodata->iter_index - 1) {
+    if (arginfodata->iter_index < 0 || index < arginfodata->iter_index) {
+      array_iter_setup(&arginfodata->iter, (AnyArrayType *) arr);
+      arginfodata->iter_index = 0;
+    }
+
+    while (arginfodata->iter_index <= index) {
+      arginfodata->iter_value = array_iter_next(&arginfodata->iter, &arginfodata->iter_isnull, arginfodata->iter_index,
+                                                cache->elmlen, cache->elmbyval, cache->elmalign);
+      arginfodata->iter_index++;
+    }
+  }
+
+  *isNull = arginfodata->iter_isnull;
+  return arginfodata->iter_value;
+}
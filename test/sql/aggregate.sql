@@ -0,0 +1,55 @@
+CREATE EXTENSION IF NOT EXISTS format_x;
+
+-- Aggregate --
+
+CREATE TABLE country(name TEXT, code CHAR(2), population INT);
+INSERT INTO country VALUES
+  ('United States', 'US', 1000),
+  ('Canada', 'CA', 30),
+  ('Mexico', 'MX', 40);
+SELECT format_x_agg('%(name)s <%(code)s>', ', ', country ORDER BY code)
+  FROM country;
+SELECT format_x_agg('%(code)s=%(population)s', '&', country ORDER BY population)
+  FROM country;
+SELECT format_x_agg('%L', ', ', name ORDER BY name) FROM country;
+SELECT format_x_agg('%(name)s', ' | ', data ORDER BY id) FROM (VALUES
+  (1, '{"name": "Canada"}'::JSONB),
+  (2, '{"name": "Mexico"}'::JSONB)
+) v(id, data);
+
+-- Aggregate with null separator, null format strings and no rows --
+
+SELECT format_x_agg('%s', NULL, x ORDER BY x) FROM generate_series(1, 3) x;
+SELECT format_x_agg(CASE WHEN x = 2 THEN NULL ELSE '<%s>' END, ',', x ORDER BY x)
+  FROM generate_series(1, 3) x;
+SELECT format_x_agg('%s', ',', x) FROM generate_series(1, 3) x WHERE x > 3;
+
+-- Aggregate with a format string changing between rows --
+
+SELECT format_x_agg(CASE WHEN x % 2 = 0 THEN '[%s]' ELSE '(%s)' END, '', x ORDER BY x)
+  FROM generate_series(1, 4) x;
+
+-- Aggregate with missing attribute --
+
+SELECT format_x_agg('%(size)s', ',', country) FROM country;
+
+-- Parallel aggregate --
+
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+SELECT length(format_x_agg('%(code)s', ',', country)) FROM country;
+
+-- Workers only seeing null format strings --
+
+SET parallel_leader_participation = off;
+SELECT format_x_agg(NULL, ',', country) IS NULL AS "null" FROM country;
+RESET parallel_leader_participation;
+
+RESET max_parallel_workers_per_gather;
+RESET min_parallel_table_scan_size;
+RESET parallel_tuple_cost;
+RESET parallel_setup_cost;
+
+DROP TABLE country;
@@ -0,0 +1,22 @@
+CREATE EXTENSION IF NOT EXISTS format_x;
+
+-- Elements of arrays --
+
+SELECT format_x('%(1)s, %(3)s', ARRAY['a', 'b', 'c']);
+SELECT format_x('%(2)s', ARRAY[10, 20, 30]);
+SELECT format_x('%(2)L %(1)I', ARRAY['it''s', NULL]);
+SELECT format_x('%(0)s', '[0:2]={x,y,z}'::TEXT[]);
+SELECT format_x('%(4)s', ARRAY['a', 'b', 'c']);
+SELECT format_x('%(first)s', ARRAY['a']);
+SELECT format_x('%(1)s', ARRAY[[1, 2], [3, 4]]);
+
+-- Composite type with array attribute --
+
+CREATE TYPE place AS (name TEXT, code TEXT);
+CREATE TYPE itinerary AS (title TEXT, places place[]);
+SELECT format_x('%(title)s: %(places.1.name)s, %(places.2.code)s', ROW('Trip', ARRAY[
+  ROW('Canada', 'CA')::place,
+  ROW('Mexico', 'MX')::place
+])::itinerary);
+DROP TYPE itinerary;
+DROP TYPE place;
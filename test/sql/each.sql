@@ -0,0 +1,29 @@
+CREATE EXTENSION IF NOT EXISTS format_x;
+
+-- Format every element of an array --
+
+CREATE TABLE region(name TEXT, code CHAR(2));
+INSERT INTO region VALUES
+  ('Ontario', 'ON'),
+  ('Quebec', 'QC');
+SELECT format_x_each('Hello %(name)s <%(code)s>', array_agg(region ORDER BY code))
+  FROM region;
+SELECT format_x_each('%s-%1$L', ARRAY['a', NULL, 'c']);
+SELECT format_x_each('[%3s]', ARRAY[[1, 2], [3, 4]]);
+SELECT format_x_each('%(name)s', ARRAY['{"name": "x"}', '{"name": "y"}']::JSONB[]);
+SELECT format_x_each('%s', '{}'::INT[]);
+SELECT format_x_each('%s', NULL::INT[]);
+
+-- Set-returning variant --
+
+SELECT * FROM format_x_unnest('%(code)I: %(name)L',
+  (SELECT array_agg(region ORDER BY code) FROM region));
+SELECT * FROM format_x_unnest('<%s>', ARRAY[[1, 2], [3, 4]]);
+SELECT * FROM format_x_unnest('%s', '{}'::INT[]);
+
+-- Missing attribute and null identifier --
+
+SELECT format_x_each('%(size)s', array_agg(region)) FROM region;
+SELECT format_x_each('%I', ARRAY['a', NULL]);
+
+DROP TABLE region;
@@ -0,0 +1,35 @@
+CREATE EXTENSION IF NOT EXISTS format_x;
+
+-- Literals as parameters --
+
+CREATE TABLE account(id INT PRIMARY KEY, owner TEXT, balance NUMERIC);
+SELECT format_x_exec('INSERT INTO %I VALUES (%L, %L, %L)', 'account', 1, 'Ann', 100);
+SELECT format_x_exec('INSERT INTO %I VALUES (%L, %L, %L)', 'account', 2, 'O''Brien', NULL);
+SELECT format_x_exec('INSERT INTO %I VALUES (%L, %L, %L)', 'account', 3, 'Cy', 50);
+SELECT format_x_exec('UPDATE account SET balance = balance + %L WHERE id = %L', 10.5, 1);
+SELECT format_x_exec('UPDATE account SET owner = %(owner)L WHERE id = %(id)L', ROW(2, 'Bea', 0)::account);
+SELECT format_x_exec('UPDATE account SET balance = %L WHERE id > %L', NULL, 1);
+SELECT format_x_exec('DELETE FROM account WHERE id = %L', '3'::TEXT);
+SELECT format_x_exec('SELECT %L', 'x');
+SELECT format_x_exec(NULL, 1);
+SELECT * FROM account ORDER BY id;
+
+-- Values of other types than strings keep their type --
+
+SELECT format_x_exec('SELECT 1 WHERE pg_typeof(%L) = %L::regtype', 1, 'integer');
+SELECT format_x_exec('SELECT 1 WHERE pg_typeof(%L) = %L::regtype', 1.5, 'numeric');
+SELECT format_x_exec('UPDATE account SET owner = %.3L WHERE id = %L', 'Bernadette', 2);
+SELECT owner FROM account WHERE id = 2;
+SELECT format_x_exec('UPDATE account SET balance = %(b)L WHERE id = %(id)L', '{"b": 7.25, "id": 1}'::JSONB);
+SELECT balance FROM account WHERE id = 1;
+
+-- Values that are not valid for the inferred type --
+
+SELECT format_x_exec('DELETE FROM account WHERE id = %L', 'one');
+
+-- Widths and parameters that can't be used --
+
+SELECT format_x_exec('SELECT %5L', 1);
+SELECT format_x_exec('SELECT %L, $2', 1);
+
+DROP TABLE account;
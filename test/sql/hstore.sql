@@ -35,3 +35,16 @@ SELECT format_x('SELECT * FROM nation WHERE code = %(code)L', hstore(ARRAY[
 -- Hstore with missing key --
 
 SELECT format_x('%(size)s', hstore(ARRAY['name', 'United Kingdom']));
+
+-- Many keys looked up in one hstore argument --
+
+SELECT format_x('%1(population)s %1(code)s %1(name)s %1(code)L', hstore(ARRAY[
+  'name', 'United States', 'code', 'US', 'population', '1000'
+]));
+SELECT format_x('%(code)s %(name)L', hstore(ARRAY['name', NULL, 'code', 'US']));
+SELECT format_x('%(k7)s %(k13)s %(k2)s',
+  hstore(array_agg('k' || i), array_agg((i * 10)::TEXT)))
+  FROM generate_series(1, 40) AS i;
+SELECT format_x('%(k7)s %(k99)s',
+  hstore(array_agg('k' || i), array_agg((i * 10)::TEXT)))
+  FROM generate_series(1, 40) AS i;
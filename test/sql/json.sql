@@ -58,6 +58,14 @@ SELECT format_x('%(n1.code)I, %(n2)L', '{
   "n2": {"name": "Canada", "code": "CA", "population": 30}
 }'::JSON);
 
+-- JSON with escapes, duplicate keys, arrays and numbers --
+
+SELECT format_x('%(a)s %(b)L', '{"\u0061": "x\"y", "b": "\u0041B"}'::JSON);
+SELECT format_x('%(a)s', '{"a": 1, "a": 2}'::JSON);
+SELECT format_x('%(a)s %(c)s', '{"a": [1, {"b": "]"}], "c": true}'::JSON);
+SELECT format_x('%(p).1s %(q).2s', '{"p": 1.25, "q": 1.5e-1}'::JSON);
+SELECT format_x('%(a.b)s', '{"a": [1]}'::JSON);
+
 -- Composite type with nested JSON attribute --
 
 CREATE TABLE description(name TEXT, data JSON);
@@ -66,3 +74,11 @@ INSERT INTO description VALUES
 SELECT format_x('%(name)I: %(data.population)s', description)
   FROM description;
 DROP TABLE description;
+
+-- Elements of JSON arrays --
+
+SELECT format_x('%(items.1.sku)s x %(items.1.count)s, %(items.0.sku)s',
+  '{"items": [{"sku": "A-1", "count": 2}, {"sku": "B-2", "count": 5}]}'::JSON);
+SELECT format_x('%(0)s %(1)L %(2.0)s', ' ["a", null, [true, false]]'::JSON);
+SELECT format_x('%(3)s', '["a", "b"]'::JSON);
+SELECT format_x('%(items.first)s', '{"items": ["a"]}'::JSON);
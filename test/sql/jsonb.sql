@@ -66,3 +66,29 @@ INSERT INTO description VALUES
 SELECT format_x('%(name)I: %(data.population)s', description)
   FROM description;
 DROP TABLE description;
+
+-- Many keys looked up in one JSONB argument --
+
+SELECT format_x('%1(extra)s%1(population)s %1(code)s %1(name)s %1(code)L',
+  '{"name": "United States", "code": "US", "population": 1000, "extra": null}'::JSONB);
+SELECT format_x('%1(code)s %2(code)s %1(name)s %2(name)s',
+  '{"name": "United States", "code": "US"}'::JSONB,
+  '{"name": "Canada", "code": "CA"}'::JSONB);
+SELECT format_x('%(n1.code)s %(n1.name)s %(n2.code)s', '{
+  "n1": {"name": "United States", "code": "US", "population": 1000},
+  "n2": {"name": "Canada", "code": "CA", "population": 30}
+}'::JSONB);
+SELECT format_x('%(k7)s %(k13)s %(k2)s', jsonb_object_agg('k' || i, i * 10))
+  FROM generate_series(1, 40) AS i;
+SELECT format_x('%(name)s %(size)s', '{"name": "United Kingdom"}'::JSONB);
+SELECT format_x('%(k7)s %(k99)s', jsonb_object_agg('k' || i, i * 10))
+  FROM generate_series(1, 40) AS i;
+SELECT format_x('%(name)s', '["name"]'::JSONB);
+
+-- Elements of JSONB arrays --
+
+SELECT format_x('%(items.1.sku)s x %(items.1.count)s, %(items.0.sku)s',
+  '{"items": [{"sku": "A-1", "count": 2}, {"sku": "B-2", "count": 5}]}'::JSONB);
+SELECT format_x('%(0)s %(1)L %(2.0)s', '["a", null, [true, false]]'::JSONB);
+SELECT format_x('%(3)s', '["a", "b"]'::JSONB);
+SELECT format_x('%(items.first)s', '{"items": ["a"]}'::JSONB);
@@ -0,0 +1,34 @@
+CREATE EXTENSION IF NOT EXISTS format_x;
+
+-- Memory used by a call site does not grow with the number of calls --
+
+CREATE TABLE city(name TEXT, code CHAR(3), data JSONB);
+INSERT INTO city VALUES
+  ('Toronto', 'YYZ', '{"province": "Ontario", "tags": ["lake", "tower"]}'::JSONB);
+
+CREATE FUNCTION format_x_memory(calls INT)
+  RETURNS TABLE(growth NUMERIC, scratch BIGINT) AS $$
+DECLARE
+  c city;
+  output TEXT;
+  baseline NUMERIC;
+BEGIN
+  SELECT * INTO c FROM city;
+  FOR i IN 1..calls LOOP
+    output := format_x('%(name)s <%(code)I> %(data.province)L %(data.tags)s %s', c, i);
+    IF i = 1000 THEN
+      SELECT sum(total_bytes) INTO baseline FROM pg_backend_memory_contexts;
+    END IF;
+  END LOOP;
+  RETURN QUERY SELECT
+    (SELECT sum(total_bytes) FROM pg_backend_memory_contexts) - baseline,
+    (SELECT max(total_bytes) FROM pg_backend_memory_contexts
+      WHERE name = 'format_x scratch');
+END
+$$ LANGUAGE plpgsql;
+
+SELECT growth < 1024 * 1024 AS flat, scratch <= 64 * 1024 AS bounded
+  FROM format_x_memory(100000);
+
+DROP FUNCTION format_x_memory(INT);
+DROP TABLE city;
@@ -0,0 +1,49 @@
+CREATE EXTENSION IF NOT EXISTS format_x;
+
+-- Floats are rounded from their shortest decimal representation --
+
+SELECT format_x('%.2s', 3.14159::FLOAT8);
+SELECT format_x('%.2s', 2.675::FLOAT8);
+SELECT format_x('%.1s', 1.25::FLOAT4);
+SELECT format_x('%.3s', 1.1::FLOAT4);
+SELECT format_x('%.0s', 99.5::FLOAT8);
+SELECT format_x('%.2s', -0.001::FLOAT8);
+SELECT format_x('%.2s', 1e20::FLOAT8);
+SELECT format_x('%.5s', 1e-5::FLOAT8);
+SELECT format_x('%.2s %.2s %.2s', 'NaN'::FLOAT8, 'Infinity'::FLOAT8, '-Infinity'::FLOAT4);
+
+-- Numerics --
+
+SELECT format_x('%.2s', 12.345::NUMERIC);
+SELECT format_x('%.3s', 12::NUMERIC);
+SELECT format_x('%.1s', -0.04::NUMERIC);
+SELECT format_x('%.0s', 2.5);
+SELECT format_x('%.2s', 'NaN'::NUMERIC);
+SELECT format_x('%(price).2s', '{"price": 9.999}'::JSONB);
+SELECT format_x('%(n).2s', '{"n": 1.5e3}'::JSON);
+SELECT format_x('%(n).2s %(m).2s', '{"n": 1e99999999999, "m": -1e-99999999999}'::JSON);
+
+-- Precision with width and quoting --
+
+SELECT format_x('|%8.2s|%-8.1L|', 3.14159::FLOAT8, 2.25::NUMERIC);
+SELECT format_x('%.2s', NULL::FLOAT8);
+
+-- Other values are truncated to precision characters --
+
+SELECT format_x('%.3s|%.0s|%.10s', 'abcdef', 'abc', 'abc');
+SELECT format_x('%.2s', 12345);
+SELECT format_x('|%5.2s|%-5.2s|', 'abcdef', 'abcdef');
+SELECT format_x('%.3s', 'ñandú'::TEXT);
+SELECT format_x('%.3L %.3I', 'it''s here', 'Hello World');
+SELECT format_x('%(name).6s', '{"name": "United States"}'::JSONB);
+SELECT format_x('%.8s', '{"a": [1, 2, 3]}'::JSONB);
+
+-- Only a prefix of TOASTed values is fetched --
+
+CREATE TABLE preview(body TEXT);
+ALTER TABLE preview ALTER COLUMN body SET STORAGE EXTERNAL;
+INSERT INTO preview VALUES (repeat('abcdefghij', 100000));
+ALTER TABLE preview ALTER COLUMN body SET STORAGE EXTENDED;
+INSERT INTO preview VALUES (repeat('xyz', 100000));
+SELECT format_x('%.15s...', body) FROM preview ORDER BY length(body);
+DROP TABLE preview;
@@ -0,0 +1,32 @@
+CREATE EXTENSION IF NOT EXISTS format_x;
+CREATE EXTENSION IF NOT EXISTS hstore;
+
+-- Statistics --
+
+CREATE TABLE statistic(name TEXT, code TEXT, data JSONB, info HSTORE);
+INSERT INTO statistic VALUES
+  ('United States', 'US', '{"population": 1000}', 'capital=>Washington'),
+  ('Canada', 'CA', '{"population": 30}', 'capital=>Ottawa');
+SELECT format_x_stats_reset();
+SELECT format_x('%1(name)s <%1(code)s>: %2(population)s, %3(capital)s', s, data, info)
+  FROM statistic s;
+SELECT format_x('%I = %L', name, code) FROM statistic;
+SELECT format_x('%(size)s', data) FROM statistic;
+SELECT calls, template_hits, template_misses, record_lookups, jsonb_lookups,
+  json_lookups, hstore_lookups, array_lookups, lookup_misses, bytes
+  FROM format_x_stats();
+
+-- Timing --
+
+SELECT compile_time = 0 AND lookup_time = 0 AND output_time = 0 AND quote_time = 0 AS untimed
+  FROM format_x_stats();
+SET format_x.track_timing = on;
+SELECT format_x('%1(name)s <%1(code)s>: %2(population)s, %3(capital)L', s, data, info)
+  FROM statistic s;
+SELECT compile_time >= 0 AND lookup_time >= 0 AND output_time >= 0 AND quote_time >= 0 AND
+       compile_time + lookup_time + output_time + quote_time > 0 AS timed
+  FROM format_x_stats();
+RESET format_x.track_timing;
+SELECT format_x_stats_reset();
+SELECT calls, bytes, lookup_time FROM format_x_stats();
+DROP TABLE statistic;
@@ -0,0 +1,66 @@
+CREATE EXTENSION IF NOT EXISTS format_x;
+
+-- Constant arguments are formatted into the format string --
+
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT format_x('%s-%s', 'a', x) FROM generate_series(1, 2) x;
+SELECT format_x('%s-%s', 'a', x) FROM generate_series(1, 2) x;
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT format_x('%(name)s %s %L %L', '{"name": "b"}'::JSONB, x, NULL::TEXT, '100%')
+  FROM generate_series(1, 2) x;
+SELECT format_x('%(name)s %s %L %L', '{"name": "b"}'::JSONB, x, NULL::TEXT, '100%')
+  FROM generate_series(1, 2) x;
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT format_x('|%3$-4s|%2$5s|%1$s|%%', 'c', x, x * 10) FROM generate_series(1, 2) x;
+SELECT format_x('|%3$-4s|%2$5s|%1$s|%%', 'c', x, x * 10) FROM generate_series(1, 2) x;
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT format_x('%(a.b)I %s', jsonb_build_object('a', jsonb_build_object('b', x::TEXT)), 'd')
+  FROM generate_series(1, 2) x;
+SELECT format_x('%(a.b)I %s', jsonb_build_object('a', jsonb_build_object('b', x::TEXT)), 'd')
+  FROM generate_series(1, 2) x;
+
+-- Constants whose text depends on settings are formatted when the call is run --
+
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT format_x('%s %s %s %I', 'a', 1.5::FLOAT8, x, 'i') FROM generate_series(1, 2) x;
+PREPARE identifier(INT) AS SELECT format_x('%I %s', 'i', $1);
+EXECUTE identifier(1);
+SET quote_all_identifiers = on;
+EXECUTE identifier(1);
+RESET quote_all_identifiers;
+DEALLOCATE identifier;
+
+-- Calls that are left alone --
+
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT format_x('%I %s', NULL::TEXT, x) FROM generate_series(1, 2) x;
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT format_x('%s %s %s', 'e', x) FROM generate_series(1, 2) x;
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT format_x('%s %s', VARIADIC ARRAY['f', x::TEXT]) FROM generate_series(1, 2) x;
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT format_x('%s', 'g');
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT format_x('%s %', 'h', x) FROM generate_series(1, 2) x;
+SELECT CASE WHEN x > 2 THEN format_x('%s %', 'h', x) END FROM generate_series(1, 2) x;
+
+-- The cost depends on the format specifiers and lookups --
+
+CREATE FUNCTION plan_cost(query TEXT) RETURNS FLOAT8 AS $$
+DECLARE
+  plan JSON;
+BEGIN
+  EXECUTE 'EXPLAIN (FORMAT JSON) ' || query INTO plan;
+  RETURN (plan->0->'Plan'->>'Total Cost')::FLOAT8;
+END
+$$ LANGUAGE plpgsql;
+SELECT plan_cost($$SELECT format_x('%s %s %s %s', x, x, x, x) FROM generate_series(1, 100) x$$) >
+       plan_cost($$SELECT format_x('%s', x) FROM generate_series(1, 100) x$$);
+SELECT plan_cost($$SELECT format_x('%(a)s', jsonb_build_object('a', x)) FROM generate_series(1, 100) x$$) >
+       plan_cost($$SELECT format_x('%s', jsonb_build_object('a', x)) FROM generate_series(1, 100) x$$);
+
+-- A call and a specifier cost 2 * cpu_operator_cost per row over the query without format_x() --
+
+SELECT round((plan_cost($$SELECT format_x('%s', x) FROM generate_series(1, 100) x$$) -
+              plan_cost($$SELECT x FROM generate_series(1, 100) x$$))::NUMERIC, 2) AS cost;
+DROP FUNCTION plan_cost(TEXT);
@@ -0,0 +1,28 @@
+CREATE EXTENSION IF NOT EXISTS format_x;
+
+-- Rows of a table --
+
+CREATE TABLE city(name TEXT, code CHAR(3), population INT, info JSONB);
+INSERT INTO city VALUES
+  ('Toronto', 'YYZ', 2800, '{"province": "ON"}'),
+  ('Montreal', 'YUL', 1800, '{"province": "QC"}'),
+  ('Vancouver', 'YVR', 700, NULL);
+SELECT format_x_table('%(name)s <%(code)s>: %(population)s', 'city');
+SELECT format_x_table('%(name)s: %(info)s', 'city');
+SELECT format_x_table('SELECT * FROM city WHERE code = %(code)L AND name = %(name)L', 'city');
+SELECT format_x_table('%s', 'city');
+
+-- Stopping early --
+
+SELECT format_x_table('%(info.province)s', 'city') LIMIT 2;
+SELECT format_x_table('%(info.province)s', 'city');
+
+-- Errors --
+
+SELECT format_x_table('%(size)s', 'city');
+SELECT format_x_table('%2$s', 'city');
+CREATE VIEW big_city AS SELECT * FROM city WHERE population > 1000;
+SELECT format_x_table('%(name)s', 'big_city');
+
+DROP VIEW big_city;
+DROP TABLE city;
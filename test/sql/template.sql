@@ -0,0 +1,40 @@
+CREATE EXTENSION IF NOT EXISTS format_x;
+
+-- Precompiled format templates --
+
+SELECT format_x('Hello %s'::format_template, 'World');
+SELECT format_x('%2$s %1$s'::format_template, 'one', 'two');
+SELECT format_x('100%%'::format_template);
+SELECT format_x(NULL::format_template, 'World');
+SELECT 'Hello %(name)s <%(code)s>'::format_template;
+SELECT 'Hello %(name)s'::format_template::TEXT;
+
+-- Templates stored in a table --
+
+CREATE TABLE greeting(id INT, template format_template);
+INSERT INTO greeting VALUES
+  (1, 'Hello %(name)s'),
+  (2, '%(code)I: %(name)L'),
+  (3, '|%(name)-10s|');
+CREATE TABLE province(name TEXT, code CHAR(2));
+INSERT INTO province VALUES
+  ('Ontario', 'ON'),
+  ('Quebec', 'QC');
+SELECT id, format_x(template, province) FROM greeting, province ORDER BY id, code;
+SELECT format_x(template, VARIADIC ARRAY['{"name": "Alberta"}'::JSONB])
+  FROM greeting WHERE id = 1;
+INSERT INTO greeting SELECT 4, 'Goodbye %s'::TEXT;
+SELECT template FROM greeting WHERE id = 4;
+
+-- Malformed templates are rejected when they are created --
+
+INSERT INTO greeting VALUES (5, 'Hello %');
+INSERT INTO greeting VALUES (5, 'Hello %y');
+INSERT INTO greeting VALUES (5, '%0$s');
+
+-- Errors that depend on the arguments still happen when formatting --
+
+SELECT format_x(template) FROM greeting WHERE id = 1;
+
+DROP TABLE province;
+DROP TABLE greeting;
@@ -60,3 +60,15 @@ select format_x('>>%-s<<', 'Hello');
 select format_x('>>%10L<<', NULL);
 /* select format_x('>>%2$*1$L<<', NULL, 'Hello'); */
 /* select format_x('>>%2$*1$L<<', 0, 'Hello'); */
+-- field widths count characters, not bytes
+select format_x('>>%10s<<', 'ñandú');
+select format_x('>>%-10s<<', 'ñandú');
+select format_x('>>%20s<<', 'abcdefghijklmnoñ');
+select format_x('>>%10I<<', 'Ñandú');
+select format_x('>>%-10L<<', 'ñandú');
+-- variadic elements are fetched as they are referred to, in any order
+select format_x('%3$s %1$s %3$s %2$s|', variadic array['a', NULL, 'c']);
+select format_x('%3$s %1$s', variadic array[1, NULL, 3]);
+select format_x('%2$s %1$s', variadic array['x', 'y']::name[]);
+select format_x('%200$s %1$s %100$s', variadic array_agg(i::text))
+from generate_series(1,200) g(i);